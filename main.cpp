@@ -1,6 +1,8 @@
 
 
 #include <stdio.h>
+//#define TESTBED_MEMORY_HOOKS
+//Count heap use per test. In one source file only, before including tests.h
 #include "tests.h"
 
 #ifdef USE_MPI
@@ -10,6 +12,7 @@
 #include <iomanip>
 #include <math.h>
 #include <cmath>
+#include <cfenv>
 
 
 #define calc_type double
@@ -32,6 +35,8 @@ class test_entity_sample : public testbed::test_entity{
   public:
   test_entity_sample(){
     name = "sample test";
+    collective = false;
+    //Purely serial, so with set_mpi_shard any one rank may run it
   }
   virtual ~test_entity_sample(){;};
   virtual testbed::TEST_ERR run();
@@ -55,8 +60,8 @@ testbed::TEST_ERR test_entity_sample::run(){
     tot = std::pow(res_el, 3) -20.5*std::pow(res_el, 2) +100.0*res_el - 112.76;
     if(std::abs(tot) > testbed::PRECISION){
       err|=testbed::TEST_WRONG_RESULT;
-      report_info("Cubic root does not solve polynomial, mismatch "+testbed::mk_str(tot)+" for root "+testbed::mk_str(res_el), 2);
-      
+      report_info(2) << "Cubic root does not solve polynomial, mismatch " << tot << " for root " << res_el;
+      //Message is only built if verbosity is 2 or more
     }
   }
   if(err == testbed::TEST_PASSED) report_info("Cubic roots OK");
@@ -66,7 +71,18 @@ testbed::TEST_ERR test_entity_sample::run(){
 
 }
 
-REGISTER(sample);
+REGISTER_TAGGED(sample, "cubic");
+//Tags can be used to select tests to run, e.g. ./main --tag cubic
+
+class fixture_root_table : public testbed::fixture{
+/** Example shared fixture, roots of a family of cubics. Built once however many tests use it*/
+  public:
+  std::vector<std::vector<double> > roots;
+  fixture_root_table(){
+    for(int i=0; i< 1000; i++) roots.push_back(cubic_solve(-20.5, 100.0, -100.0 - 0.01*i));
+  }
+};
+REGISTER_FIXTURE(root_table);
 
 class test_entity_second : public testbed::test_entity{
 /** */
@@ -75,6 +91,8 @@ class test_entity_second : public testbed::test_entity{
   public:
   test_entity_second(){
     name = "second";
+    uses_fixture("root_table");
+    //Declaring the fixture lets it be freed as soon as the last test using it is done
   }
   virtual ~test_entity_second(){;};
   virtual testbed::TEST_ERR run();
@@ -86,6 +104,12 @@ class test_entity_second : public testbed::test_entity{
 };
 testbed::TEST_ERR test_entity_second::run(){
   report_info("Number is "+testbed::mk_str(number));
+  const fixture_root_table * table = get_fixture<fixture_root_table>("root_table");
+  if(!table){
+    report_err(testbed::TEST_NULL_RESULT);
+    return testbed::TEST_NULL_RESULT;
+  }
+  report_info("Root table has "+testbed::mk_str(table->roots.size())+" entries", 2);
   report_err(testbed::TEST_PASSED);
   return testbed::TEST_PASSED;
 }
@@ -157,6 +181,588 @@ testbed::TEST_ERR test_entity_setup2::run(){
   return testbed::TEST_PASSED;
 }
 REGISTER(setup2);
+
+class test_entity_nan_compare : public testbed::test_entity{
+/** Example of checking results which may hold NaNs*/
+  private:
+  public:
+  test_entity_nan_compare(){
+    name = "NaN comparison";
+  }
+  virtual ~test_entity_nan_compare(){;};
+  virtual testbed::TEST_ERR run();
+};
+testbed::TEST_ERR test_entity_nan_compare::run(){
+/** \brief NaNs must count as mismatches, on either side, without the comparison itself raising an invalid operation, which set_fp_checks would blame on the test*/
+  testbed::TEST_ERR err = testbed::TEST_PASSED;
+  //Check the flags here, whatever set_fp_checks says, and leave them as they were for it
+  std::fexcept_t outer_flags;
+  std::fegetexceptflag(&outer_flags, FE_ALL_EXCEPT);
+  std::feclearexcept(FE_ALL_EXCEPT);
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  std::vector<double> expected(1001), result;
+  for(size_t i=0; i< expected.size(); i++) expected[i] = 0.5*i - 100.0;
+  result = expected;
+  //In vectorised blocks and in the scalar tail
+  result[3] = nan;
+  expected[700] = nan;
+  result[1000] = nan;
+  const int tol_types[3] = {testbed::TOL_ABSOLUTE, testbed::TOL_RELATIVE, testbed::TOL_ULP};
+  for(int i=0; i< 3; i++){
+    testbed::compare_summary summary = testbed::compare_arrays(result, expected, testbed::PRECISION, tol_types[i]);
+    if(summary.n_over != 3 || summary.max_err != std::numeric_limits<double>::infinity() || summary.max_index != 3){
+      err |= testbed::TEST_WRONG_RESULT;
+      report_info("Wrong NaN handling: "+testbed::mk_str(summary), 0);
+    }
+  }
+  if(std::fetestexcept(FE_INVALID | FE_DIVBYZERO)){
+    err |= testbed::TEST_FP_EXCEPTION;
+    report_info("Comparison raised a floating-point exception", 0);
+  }
+  std::fesetexceptflag(&outer_flags, FE_ALL_EXCEPT);
+  report_err(err);
+  return err;
+}
+REGISTER(nan_compare);
+
+class test_entity_arena_reuse : public testbed::test_entity{
+/** Self-test: test objects built and freed one at a time reuse one arena block*/
+  private:
+  public:
+  test_entity_arena_reuse(){
+    name = "arena reuse";
+    serial_only = true;
+    //Counts are global, so nothing else may build tests meanwhile
+  }
+  virtual ~test_entity_arena_reuse(){;};
+  virtual testbed::TEST_ERR run();
+};
+testbed::TEST_ERR test_entity_arena_reuse::run(){
+  testbed::alloc_counts & counts = testbed::alloc_counts::instance();
+  size_t blocks_before = counts.arena_blocks.load(), built_before = counts.entities.load();
+  //A fresh thread has an empty arena. Ours holds this test
+  std::thread builder([](){
+    for(int i=0; i< 20000; i++) testbed::test_factory::instance()->create("setup");
+  });
+  builder.join();
+  size_t n_blocks = counts.arena_blocks.load() - blocks_before;
+  report_info("20000 test objects used "+testbed::mk_str(n_blocks)+" arena blocks", 2);
+  testbed::TEST_ERR err = testbed::TEST_PASSED;
+  if(counts.entities.load() - built_before != 20000 || n_blocks != 1) err |= testbed::TEST_WRONG_RESULT;
+  report_err(err);
+  return err;
+}
+REGISTER(arena_reuse);
+
+class nested_run{
+/** Self-test helper: runs tests in a testbed of its own, in a thread of its own, with default settings and a scratch directory. Screen output is captured, and the outer run's settings are restored after*/
+  private:
+  testbed::config saved;
+  std::vector<std::string> made;
+  public:
+  std::string dir;
+  std::stringstream screen;/**< What the run printed*/
+  struct outcome{
+    std::string name;
+    int code;
+    std::string record;/**< The whole JSON Lines record, with the test's output*/
+  };
+  nested_run() : saved(*testbed::config::instance()){
+    testbed::flush_log();
+    char scratch[] = "/tmp/testbed_selftest_XXXXXX";
+    if(mkdtemp(scratch)) dir = scratch;
+    testbed::config fresh;
+    fresh.mpi_info = saved.mpi_info;
+    fresh.last_err = saved.last_err;
+    for(int i=0; i< testbed::max_err; i++) fresh.err_names[i] = saved.err_names[i];
+    fresh.filename = file("nested.log");
+    fresh.jsonl_file = file("nested.jsonl");
+    fresh.golden_dir = dir;
+    *testbed::config::instance() = fresh;
+    //Through set_selection, so the registry forgets what it had selected
+    testbed::set_selection(fresh.selection);
+  }
+  ~nested_run(){
+    *testbed::config::instance() = saved;
+    testbed::set_selection(saved.selection);
+    for(size_t i=0; i< made.size(); i++) std::remove(made[i].c_str());
+    if(!dir.empty()) rmdir(dir.c_str());
+  }
+  std::string file(const std::string & name){
+  /** Path of a file in the scratch directory, which is removed after*/
+    made.push_back(dir+"/"+name);
+    return made.back();
+  }
+  std::vector<outcome> run(const std::vector<std::string> & names){
+  /** Add and run the named tests, returning each one's name and error code in the order logged*/
+    std::streambuf * screen_buf = std::cout.rdbuf(screen.rdbuf());
+    std::thread runner([&names](){
+      testbed::tests bed;
+      bed.setup_tests();
+      for(size_t i=0; i< names.size(); i++) bed.add(names[i]);
+      bed.run_tests();
+    });
+    runner.join();
+    std::cout.rdbuf(screen_buf);
+    std::vector<outcome> outcomes;
+    std::ifstream results(testbed::config::instance()->jsonl_file.c_str());
+    std::string line;
+    while(std::getline(results, line)){
+      outcome entry;
+      size_t name_at = line.find("\"name\":\"") + 8, code_at = line.find("\"code\":") + 7;
+      entry.name = line.substr(name_at, line.find('"', name_at) - name_at);
+      entry.code = std::atoi(line.c_str() + code_at);
+      entry.record = line;
+      outcomes.push_back(entry);
+    }
+    return outcomes;
+  }
+};
+
+class test_entity_sleeper : public testbed::test_entity{
+/** Helper for self-tests, which runs past any short time limit, stopping once cancelled*/
+  private:
+  public:
+  test_entity_sleeper(){
+    name = "sleeper";
+  }
+  virtual ~test_entity_sleeper(){;};
+  virtual testbed::TEST_ERR run(){
+    for(int i=0; i< 2000 && !cancelled(); i++) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    return testbed::TEST_PASSED;
+  }
+};
+REGISTER_TAGGED(sleeper, "helper");
+
+class test_entity_fork_watchdog : public testbed::test_entity{
+/** Self-test: isolated workers are forked while the watchdog is killing others, and none hangs*/
+  private:
+  public:
+  test_entity_fork_watchdog(){
+    name = "fork under watchdog";
+    serial_only = true;
+    //Changes global settings while it runs
+  }
+  virtual ~test_entity_fork_watchdog(){;};
+  virtual testbed::TEST_ERR run();
+};
+testbed::TEST_ERR test_entity_fork_watchdog::run(){
+  nested_run nested;
+  testbed::set_isolation(2);
+  testbed::set_default_timeout(0.02);
+  //Every test times out, so each replacement worker is forked as the watchdog handles the other's timeout
+  std::vector<nested_run::outcome> outcomes = nested.run(std::vector<std::string>(20, "sleeper"));
+  testbed::TEST_ERR err = (outcomes.size() == 20) ? testbed::TEST_PASSED : testbed::TEST_WRONG_RESULT;
+  for(size_t i=0; i< outcomes.size(); i++) if(outcomes[i].code != testbed::TEST_TIMEOUT) err |= testbed::TEST_WRONG_RESULT;
+  if(err != testbed::TEST_PASSED) report_info(nested.screen.str(), 0);
+  report_err(err);
+  return err;
+}
+REGISTER(fork_watchdog);
+
+class test_entity_selection : public testbed::test_entity{
+/** Self-test: tests are picked by glob, regular expression, tag and shard, and --list runs nothing*/
+  private:
+  public:
+  test_entity_selection(){
+    name = "test selection";
+    serial_only = true;
+  }
+  virtual ~test_entity_selection(){;};
+  virtual testbed::TEST_ERR run();
+};
+testbed::TEST_ERR test_entity_selection::run(){
+  testbed::TEST_ERR err = testbed::TEST_PASSED;
+  const char * added[] = {"sample", "setup", "setup2", "second", "fail"};
+  std::vector<std::string> names(added, added+5);
+  std::vector<std::pair<testbed::test_selection, std::string> > cases(6);
+  cases[0].first.include.push_back("setup*");
+  cases[0].second = "setup,setup2";
+  cases[1].first.include.push_back("re:^s(ample|econd)$");
+  cases[1].second = "sample test,second";
+  cases[2].first.exclude.push_back("setup*");
+  cases[2].second = "sample test,second,fails";
+  cases[3].first.tags.push_back("cubic");
+  cases[3].second = "sample test";
+  cases[4].first.exclude_tags.push_back("cubic");
+  cases[4].second = "setup,setup2,second,fails";
+  cases[5].first.shard = 2;
+  cases[5].first.n_shards = 2;
+  //Dealt round-robin in the order added
+  cases[5].second = "setup,second";
+  for(size_t i=0; i< cases.size(); i++){
+    nested_run nested;
+    testbed::set_selection(cases[i].first);
+    std::vector<nested_run::outcome> outcomes = nested.run(names);
+    std::string ran;
+    for(size_t j=0; j< outcomes.size(); j++) ran += (j ? "," : "")+outcomes[j].name;
+    if(ran != cases[i].second){
+      err |= testbed::TEST_WRONG_RESULT;
+      report_info("Selection case "+testbed::mk_str(i)+" ran "+ran+", expected "+cases[i].second, 0);
+    }
+  }
+  //As from the command line
+  nested_run nested;
+  char arg0[] = "main", arg1[] = "--list", arg2[] = "--filter", arg3[] = "setup*";
+  char * argv[] = {arg0, arg1, arg2, arg3};
+  if(!testbed::parse_args(4, argv)) err |= testbed::TEST_WRONG_RESULT;
+  std::vector<nested_run::outcome> outcomes = nested.run(names);
+  std::string listed = nested.screen.str();
+  if(!outcomes.empty() || listed.find("  setup\n") == std::string::npos || listed.find("  setup2\n") == std::string::npos || listed.find("sample") != std::string::npos){
+    err |= testbed::TEST_WRONG_RESULT;
+    report_info("Wrong --list output: "+listed, 0);
+  }
+  report_err(err);
+  return err;
+}
+REGISTER(selection);
+
+class test_entity_golden_check : public testbed::test_entity{
+/** Helper for self-tests, checking a small array against a golden file*/
+  private:
+  public:
+  static double offset;/**< Added to the data, to make it differ from the reference*/
+  test_entity_golden_check(){
+    name = "golden check";
+  }
+  virtual ~test_entity_golden_check(){;};
+  virtual testbed::TEST_ERR run(){
+    std::vector<double> data(4);
+    for(size_t i=0; i< data.size(); i++) data[i] = 0.5*i + offset;
+    testbed::TEST_ERR err = check_golden("selftest", data, 1e-6, testbed::TOL_ABSOLUTE);
+    report_err(err);
+    return err;
+  }
+};
+double test_entity_golden_check::offset = 0.0;
+REGISTER_TAGGED(golden_check, "helper");
+
+class test_entity_golden : public testbed::test_entity{
+/** Self-test: a golden file is written on regeneration, then matches the same data and not different data*/
+  private:
+  public:
+  test_entity_golden(){
+    name = "golden files";
+    serial_only = true;
+  }
+  virtual ~test_entity_golden(){;};
+  virtual testbed::TEST_ERR run();
+};
+testbed::TEST_ERR test_entity_golden::run(){
+  nested_run nested;
+  nested.file("selftest.golden");
+  std::vector<std::string> names(1, "golden_check");
+  const int expected[3] = {testbed::TEST_PASSED, testbed::TEST_PASSED, testbed::TEST_WRONG_RESULT};
+  testbed::TEST_ERR err = testbed::TEST_PASSED;
+  for(int i=0; i< 3; i++){
+    //Write the reference, then check the same data, then data off by more than the tolerance
+    testbed::set_regenerate_golden(i == 0);
+    test_entity_golden_check::offset = (i == 2) ? 1e-3 : 0.0;
+    std::vector<nested_run::outcome> outcomes = nested.run(names);
+    if(outcomes.size() != 1 || outcomes[0].code != expected[i]){
+      err |= testbed::TEST_WRONG_RESULT;
+      report_info("Golden step "+testbed::mk_str(i)+" gave "+(outcomes.empty() ? std::string("nothing") : outcomes[0].record), 0);
+    }
+  }
+  test_entity_golden_check::offset = 0.0;
+  report_err(err);
+  return err;
+}
+REGISTER(golden);
+
+class test_entity_timed_sleep : public testbed::test_entity{
+/** Helper for self-tests, taking as long as asked*/
+  private:
+  public:
+  static int delay_ms;
+  test_entity_timed_sleep(){
+    name = "timed sleep";
+  }
+  virtual ~test_entity_timed_sleep(){;};
+  virtual testbed::TEST_ERR run(){
+    std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+    report_err(testbed::TEST_PASSED);
+    return testbed::TEST_PASSED;
+  }
+};
+int test_entity_timed_sleep::delay_ms = 1;
+REGISTER_TAGGED(timed_sleep, "helper");
+
+class test_entity_history : public testbed::test_entity{
+/** Self-test: once there are enough past runs, a much slower run fails as a performance regression*/
+  private:
+  public:
+  test_entity_history(){
+    name = "performance history";
+    serial_only = true;
+  }
+  virtual ~test_entity_history(){;};
+  virtual testbed::TEST_ERR run();
+};
+testbed::TEST_ERR test_entity_history::run(){
+  nested_run nested;
+  testbed::set_history(nested.file("selftest.history"));
+  testbed::set_revision("selftest");
+  std::vector<std::string> names(1, "timed_sleep");
+  testbed::TEST_ERR err = testbed::TEST_PASSED;
+  //Five runs make a baseline, then one thirty times slower
+  for(int i=0; i< 6; i++){
+    test_entity_timed_sleep::delay_ms = (i < 5) ? 2 : 60;
+    std::vector<nested_run::outcome> outcomes = nested.run(names);
+    int expected = (i < 5) ? testbed::TEST_PASSED : testbed::TEST_PERF_REGRESSION;
+    if(outcomes.size() != 1 || outcomes[0].code != expected){
+      err |= testbed::TEST_WRONG_RESULT;
+      report_info("History run "+testbed::mk_str(i)+" gave "+(outcomes.empty() ? std::string("nothing") : outcomes[0].record), 0);
+    }
+  }
+  test_entity_timed_sleep::delay_ms = 1;
+  report_err(err);
+  return err;
+}
+REGISTER(history);
+
+class test_entity_timeouts : public testbed::test_entity{
+/** Self-test: tests running over a default time limit fail as timed out, serially and in parallel, and others are unaffected. Once a whole-suite limit is up, no more tests start*/
+  private:
+  public:
+  test_entity_timeouts(){
+    name = "time limits";
+    serial_only = true;
+  }
+  virtual ~test_entity_timeouts(){;};
+  virtual testbed::TEST_ERR run();
+};
+testbed::TEST_ERR test_entity_timeouts::run(){
+  testbed::TEST_ERR err = testbed::TEST_PASSED;
+  const char * added[] = {"sleeper", "sample", "sleeper", "sleeper"};
+  std::vector<std::string> names(added, added+4);
+  for(int i=0; i< 3; i++){
+    nested_run nested;
+    //Each sleeper stops when cancelled. Past the suite limit, the rest aren't started, and also time out
+    if(i < 2) testbed::set_default_timeout(0.02);
+    else testbed::set_suite_timeout(0.05);
+    testbed::set_parallelism(i == 1 ? 2 : 1);
+    std::vector<nested_run::outcome> outcomes = nested.run(names);
+    bool right = outcomes.size() == 4;
+    for(size_t j=0; j< outcomes.size() && right; j++){
+      bool timed_out = outcomes[j].name == "sleeper" || i == 2;
+      right = (outcomes[j].code == (timed_out ? testbed::TEST_TIMEOUT : testbed::TEST_PASSED));
+    }
+    if(!right){
+      err |= testbed::TEST_WRONG_RESULT;
+      report_info("Time limit case "+testbed::mk_str(i)+" gave "+nested.screen.str(), 0);
+    }
+  }
+  report_err(err);
+  return err;
+}
+REGISTER(timeouts);
+
+class test_entity_crasher : public testbed::test_entity{
+/** Helper for self-tests, which crashes, but only in a worker process, so it can't take down a whole run*/
+  private:
+  public:
+  test_entity_crasher(){
+    name = "crasher";
+  }
+  virtual ~test_entity_crasher(){;};
+  virtual testbed::TEST_ERR run(){
+    report_info("About to crash", 0);
+    if(testbed::config::instance()->n_isolated > 0) std::raise(SIGSEGV);
+    report_err(testbed::TEST_PASSED);
+    return testbed::TEST_PASSED;
+  }
+};
+REGISTER_TAGGED(crasher, "helper");
+
+class test_entity_crash_recovery : public testbed::test_entity{
+/** Self-test: in isolated mode, a crashing test fails with the signal and what it printed first, and the rest still run*/
+  private:
+  public:
+  test_entity_crash_recovery(){
+    name = "crash recovery";
+    serial_only = true;
+  }
+  virtual ~test_entity_crash_recovery(){;};
+  virtual testbed::TEST_ERR run();
+};
+testbed::TEST_ERR test_entity_crash_recovery::run(){
+  nested_run nested;
+  testbed::set_isolation(2);
+  const char * added[] = {"sample", "crasher", "setup", "crasher", "setup2"};
+  std::vector<nested_run::outcome> outcomes = nested.run(std::vector<std::string>(added, added+5));
+  bool right = outcomes.size() == 5;
+  for(size_t i=0; i< outcomes.size() && right; i++){
+    if(outcomes[i].name != "crasher") right = outcomes[i].code == testbed::TEST_PASSED;
+    else right = outcomes[i].code == testbed::TEST_OTHER && outcomes[i].record.find("About to crash") != std::string::npos && outcomes[i].record.find("SIGSEGV") != std::string::npos;
+  }
+  testbed::TEST_ERR err = right ? testbed::TEST_PASSED : testbed::TEST_WRONG_RESULT;
+  if(!right) report_info("Crash recovery gave "+nested.screen.str(), 0);
+  report_err(err);
+  return err;
+}
+REGISTER(crash_recovery);
+
+class fixture_counted : public testbed::fixture{
+/** Helper fixture for self-tests, counting how often it is built and how many are alive*/
+  public:
+  static int n_built, n_live;
+  fixture_counted(){
+    n_built++;
+    n_live++;
+  }
+  virtual ~fixture_counted(){n_live--;}
+};
+int fixture_counted::n_built = 0;
+int fixture_counted::n_live = 0;
+REGISTER_FIXTURE(counted);
+
+class test_entity_fixture_user : public testbed::test_entity{
+/** Helper for self-tests, declaring its fixture*/
+  private:
+  public:
+  test_entity_fixture_user(){
+    name = "fixture user";
+    uses_fixture("counted");
+  }
+  virtual ~test_entity_fixture_user(){;};
+  virtual testbed::TEST_ERR run(){
+    bool right = get_fixture<fixture_counted>("counted") && fixture_counted::n_built == 1;
+    testbed::TEST_ERR err = right ? testbed::TEST_PASSED : testbed::TEST_WRONG_RESULT;
+    report_err(err);
+    return err;
+  }
+};
+REGISTER_TAGGED(fixture_user, "helper");
+
+class test_entity_fixture_grabber : public testbed::test_entity{
+/** Helper for self-tests, using a fixture it didn't declare*/
+  private:
+  public:
+  test_entity_fixture_grabber(){
+    name = "fixture grabber";
+  }
+  virtual ~test_entity_fixture_grabber(){;};
+  virtual testbed::TEST_ERR run(){
+    testbed::TEST_ERR err = get_fixture<fixture_counted>("counted") ? testbed::TEST_PASSED : testbed::TEST_NULL_RESULT;
+    report_err(err);
+    return err;
+  }
+};
+REGISTER_TAGGED(fixture_grabber, "helper");
+
+class test_entity_fixture_after : public testbed::test_entity{
+/** Helper for self-tests, run after the fixture's users, checking it was built once and is still alive only if expected*/
+  private:
+  public:
+  static int expected_live;
+  test_entity_fixture_after(){
+    name = "fixture after";
+  }
+  virtual ~test_entity_fixture_after(){;};
+  virtual testbed::TEST_ERR run(){
+    bool right = fixture_counted::n_built == 1 && fixture_counted::n_live == expected_live;
+    testbed::TEST_ERR err = right ? testbed::TEST_PASSED : testbed::TEST_WRONG_RESULT;
+    report_err(err);
+    return err;
+  }
+};
+int test_entity_fixture_after::expected_live = 0;
+REGISTER_TAGGED(fixture_after, "helper");
+
+class test_entity_fixture_lifetime : public testbed::test_entity{
+/** Self-test: a shared fixture is built once, freed after its last declared user, kept to the end if any test uses it undeclared, and never leaked*/
+  private:
+  public:
+  test_entity_fixture_lifetime(){
+    name = "fixture lifetime";
+    serial_only = true;
+  }
+  virtual ~test_entity_fixture_lifetime(){;};
+  virtual testbed::TEST_ERR run();
+};
+testbed::TEST_ERR test_entity_fixture_lifetime::run(){
+  testbed::TEST_ERR err = testbed::TEST_PASSED;
+  const char * declared[] = {"fixture_user", "fixture_user", "fixture_after"};
+  const char * undeclared[] = {"fixture_grabber", "fixture_user", "fixture_after"};
+  for(int i=0; i< 2; i++){
+    nested_run nested;
+    fixture_counted::n_built = 0;
+    test_entity_fixture_after::expected_live = i;
+    std::vector<nested_run::outcome> outcomes = nested.run(std::vector<std::string>(i ? undeclared : declared, (i ? undeclared : declared)+3));
+    bool right = outcomes.size() == 3 && fixture_counted::n_live == 0;
+    for(size_t j=0; j< outcomes.size(); j++) right = right && outcomes[j].code == testbed::TEST_PASSED;
+    if(!right){
+      err |= testbed::TEST_WRONG_RESULT;
+      report_info("Fixture case "+testbed::mk_str(i)+" gave "+nested.screen.str(), 0);
+    }
+  }
+  report_err(err);
+  return err;
+}
+REGISTER(fixture_lifetime);
+
+class fixture_broken : public testbed::fixture{
+/** Helper fixture for self-tests, which can't be built*/
+  public:
+  fixture_broken(){throw std::runtime_error("broken on purpose");}
+};
+REGISTER_FIXTURE(broken);
+
+class test_entity_broken_fixture_user : public testbed::test_entity{
+/** Helper for self-tests, needing a fixture which can't be built*/
+  private:
+  public:
+  test_entity_broken_fixture_user(){
+    name = "broken fixture user";
+    uses_fixture("broken");
+  }
+  virtual ~test_entity_broken_fixture_user(){;};
+  virtual testbed::TEST_ERR run(){
+    testbed::TEST_ERR err = get_fixture<fixture_broken>("broken") ? testbed::TEST_PASSED : testbed::TEST_NULL_RESULT;
+    report_err(err);
+    return err;
+  }
+};
+REGISTER_TAGGED(broken_fixture_user, "helper");
+
+class test_entity_fixture_failure : public testbed::test_entity{
+/** Self-test: when a fixture's constructor throws, tests sharing threads which wait for it are woken, and all fail with TEST_OTHER and the reason*/
+  private:
+  public:
+  test_entity_fixture_failure(){
+    name = "fixture failure";
+    serial_only = true;
+  }
+  virtual ~test_entity_fixture_failure(){;};
+  virtual testbed::TEST_ERR run();
+};
+testbed::TEST_ERR test_entity_fixture_failure::run(){
+  nested_run nested;
+  testbed::set_parallelism(2);
+  std::vector<nested_run::outcome> outcomes = nested.run(std::vector<std::string>(4, "broken_fixture_user"));
+  bool right = outcomes.size() == 4;
+  for(size_t i=0; i< outcomes.size(); i++) right = right && (outcomes[i].code & testbed::TEST_OTHER) && outcomes[i].record.find("broken on purpose") != std::string::npos;
+  testbed::TEST_ERR err = right ? testbed::TEST_PASSED : testbed::TEST_WRONG_RESULT;
+  if(!right) report_info("Fixture failure gave "+nested.screen.str(), 0);
+  report_err(err);
+  return err;
+}
+REGISTER(fixture_failure);
+
+class test_entity_cubic_bench : public testbed::benchmark_entity{
+/** Example benchmark, timing the cubic solver*/
+  private:
+  public:
+  test_entity_cubic_bench(){
+    name = "cubic solver speed";
+  }
+  virtual ~test_entity_cubic_bench(){;};
+  virtual void kernel(){
+    testbed::do_not_optimize(cubic_solve(-20.5, 100.0, -112.76));
+  }
+};
+REGISTER_BENCH(cubic_bench);
 }
 
 int main(int argc, char ** argv){
@@ -164,11 +770,16 @@ int main(int argc, char ** argv){
   testbed::tests * mytestbed = new testbed::tests();
 
 #ifdef USE_MPI
-  mpi_info_struc mpi_info = setup_MPI(argc, argv);
+  mpi_info_struc mpi_info = testbed_example::setup_MPI(argc, argv);
   testbed::set_mpi(mpi_info);
+  testbed::set_mpi_reduce(true);
+  //Report failures from all ranks, not just rank 0
+  testbed::set_mpi_shard(true);
+  //Share out tests marked as not collective between ranks
 #endif
 
-  testbed_example::example_testing(mytestbed);
+  //Select tests from the command line, e.g. ./main --filter "setup*" --shard 1/2
+  if(testbed::parse_args(argc, argv)) testbed_example::example_testing(mytestbed);
   
   delete mytestbed;
 
@@ -177,7 +788,7 @@ int main(int argc, char ** argv){
 #endif
 }
 
-mpi_info_struc setup_MPI(int argc, char ** argv){
+mpi_info_struc testbed_example::setup_MPI(int argc, char ** argv){
 /** \brief Example of MPI setup
 *
 * Creates an mpi_info_struc and sets n_procs and rank according to MPI library functions
@@ -206,13 +817,45 @@ namespace testbed_example{
 
 void example_testing(testbed::tests * mytestbed){
   testbed::set_filename("testing.log");
+  //testbed::set_jsonl_file("testing.jsonl");
+  //Also write results in machine-readable form. See also set_junit_file
+  //testbed::set_trace_file("testing_trace.json");
+  //Write a timeline of the run, to see where time goes when tests share threads
   testbed::set_colour("fail", 'm');
+  //testbed::set_parallelism(2);
+  //Share tests between two threads. Output is still logged in the order tests were added
+  //testbed::set_async_log(true);
+  //Write output from a background thread, in batches
+  //testbed::set_isolation(2);
+  //Or, run tests in two worker processes, so a crashing test can't take down the rest
+  //testbed::set_history("testing.history");
+  //Keep a history of test times, and fail tests which have got much slower
+  //testbed::set_schedule(testbed::SCHEDULE_FAILED_FIRST);
+  //With a history, run tests which failed last time first, then the longest
+  //testbed::set_fp_checks(testbed::FP_CHECK_FAIL);
+  //Fail tests which make NaNs or divide by zero, and warn of overflow and denormals
+  //testbed::measure_roofline();
+  //Measure memory bandwidth and peak FLOP rate, to compare tests declaring bytes_moved or flops with
+  //testbed::set_memory_budget(1<<30);
+  //With TESTBED_MEMORY_HOOKS, fail tests whose heap use peaks over 1 GiB
 
   mytestbed->setup_tests();
 
   //Adding simple tests:
   mytestbed->add("sample");
   mytestbed->add("fail");
+  mytestbed->add("nan_compare");
+
+  //Self-tests of the testbed's own features
+  mytestbed->add("arena_reuse");
+  mytestbed->add("fork_watchdog");
+  mytestbed->add("selection");
+  mytestbed->add("golden");
+  mytestbed->add("history");
+  mytestbed->add("timeouts");
+  mytestbed->add("crash_recovery");
+  mytestbed->add("fixture_lifetime");
+  mytestbed->add("fixture_failure");
 
   //Adding a test with an argument-less setup function, with and without invoking it
   mytestbed->add("setup");
@@ -235,6 +878,14 @@ void example_testing(testbed::tests * mytestbed){
   myfun = MEMBER_BIND_NOARG(tmpfn3);
   mytestbed->add("second", myfun);
 
+  //Adding a benchmark, exactly as a test
+  mytestbed->add("cubic_bench");
+
+  //Or run a benchmark at several thread counts, logging speedups and writing them as CSV. The kernel should use benchmark_entity::threads
+  //testbed::scaling_study study("cubic_bench", "cubic_scaling.csv");
+  //study.threads = {1, 2, 4};
+  //mytestbed->add_scaling(study);
+
   testbed::my_print("Available tests:");
   mytestbed->print_available();
 
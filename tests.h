@@ -36,6 +36,8 @@ mylog.log now contains all test results and additional information. See the exam
 
 \section Log Output
 Simple output control is provided via \ref test_entity::report_info "report_info" and \ref test_entity::report_err "report_err" and also via the direct my_print() functions.
+Tests may report from threads they start, e.g. in an OpenMP region. Those reports are buffered per thread without locking, and logged after run() returns, ordered by testbed::set_thread_index so the log doesn't depend on scheduling. Such threads must finish before run() returns.
+testbed::set_trace_file writes a timeline of the run, viewable in chrome://tracing or Perfetto, showing when each test ran on which thread, process and rank. Tests can mark phases of their own with a testbed::trace_scope.
 \subsection MPI MPI
 Very basic MPI support is provided. Logging can be done by all ranks, or by only one, rank 0 by default. To enable this, create a testbed::mpi_info_struc and set the two fields, rank and n_procs. See ::testbed_example::setup_MPI().
 
@@ -59,6 +61,36 @@ If the setup function has overloads with different number/type of arguments, the
 \copydoc dummy_overload
 See also testbed_example::example_testing().
 
+\subsection Select Choosing tests to run
+Tests added are filtered by testbed::set_selection, usually set from the command line with testbed::parse_args. Tests can be picked by glob or regular expression on their registered name, or by tags given with REGISTER_TAGGED, with exclusions, and split into shards with --shard I/N so separate jobs each run part of a suite. tests::add_all adds everything selected, and --list shows what would run.
+
+\section Arrays Comparing arrays
+testbed::compare_arrays checks a result array against expected values to an absolute, relative or ULP tolerance, using SIMD and optionally threads. It returns a testbed::compare_summary with the error code to report, and mk_str gives a summary for report_info.
+
+\subsection Golden Golden reference data
+Large expected results can be kept in binary golden files, which are memory mapped rather than read in. In a test, test_entity::check_golden("name", data, shape) compares against name.golden in the directory set by testbed::set_golden_dir. Run once with testbed::set_regenerate_golden(true) to write the files, with the tolerance to use.
+
+\subsection Fixture Sharing expensive setup
+Setup needed by several tests, such as building a large mesh, can go in a fixture, derived from testbed::fixture and registered with REGISTER_FIXTURE. Tests call test_entity::get_fixture to use it. It is built once, on first use, shared read-only, and freed once the last test which declared it with test_entity::uses_fixture is done. See ::testbed_example::test_entity_second.
+
+\section Bench Writing a benchmark
+Derive from testbed::benchmark_entity instead of test_entity, implement kernel() to do one unit of work, and register with REGISTER_BENCH. Pass results to testbed::do_not_optimize() so the work isn't optimised away. The harness handles warm-up, choosing the number of calls and the statistics. See ::testbed_example::test_entity_cubic_bench.
+A test or benchmark setting test_entity::bytes_moved or test_entity::flops gets its achieved GB/s and GFLOP/s reported. After testbed::measure_roofline, which times a STREAM triad and a multiply-add loop once, these are also given as fractions of the machine's bandwidth, peak and roofline, e.g. to show a kernel runs at 30% of memory bandwidth.
+With testbed::set_perf_counters, each test and benchmark also reports CPU counters, such as instructions per cycle and cache misses per thousand instructions, to help tell why a kernel got slower.
+
+\subsection Scaling Scaling studies
+A testbed::scaling_study runs one benchmark over a grid of problem sizes, thread counts and MPI rank counts, added with tests::add_scaling. Sizes are set up with ADDABLE_FN functions, just as for tests::add, and the benchmark uses benchmark_entity::threads and benchmark_entity::comm. After the run, speedup, parallel efficiency, Karp-Flatt metric and weak-scaling efficiency are logged and written as CSV.
+
+\subsection History Performance history
+With testbed::set_history, each run appends every test's time to a history file, keyed by test name, source revision and host. A test much slower than its recent history on this host fails with TEST_PERF_REGRESSION, just like a wrong result.
+The history also gives each test's last time and outcome, so testbed::set_schedule can run the longest, or last failed, tests first. testbed::set_fail_fast stops at the first failure.
+
+\subsection Memory Heap use
+Defining TESTBED_MEMORY_HOOKS before including tests.h, in one source file only, replaces the global operator new and delete to count each test's heap use. Allocations, bytes and peak heap in run() are logged at verbosity 2, and anything allocated but not freed by the end of the test, including the test's destructor, is logged as a leak. A test setting test_entity::memory_budget, or all tests with testbed::set_memory_budget, fails with TEST_MEMORY if its peak goes over. Counts are kept per thread, so cost little, but only cover the thread calling run(): memory a test's own threads allocate, or a block freed by another thread, isn't seen. Direct malloc calls aren't seen either.
+
+\subsection FP Floating-point checks
+With testbed::set_fp_checks, the floating-point exception flags are checked around each test, warning of NaNs made by invalid operations, division by zero, overflow and slow denormal arithmetic, and optionally failing the test with TEST_FP_EXCEPTION or TEST_DENORMAL. FP_CHECK_TRAP stops at the offending operation instead, best used with testbed::set_isolation.
+
 \section Macros What are all these macros doing?
 The previous section involves using several macros. These are a shortcut to writing out the syntax, and are NOT nest-safe. A makefile recipe, preprocess, is given to expand these by preprocessing JUST the relevant file and the tests.h header. Alternately, use the expanded syntax directly. 
 
@@ -77,10 +109,66 @@ The previous section involves using several macros. These are a shortcut to writ
 #include <string>
 #include <memory>
 #include <map>
+#include <functional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <sys/resource.h>
+#include <cmath>
+#include <type_traits>
+#include <exception>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <cstdint>
+#include <limits>
+#include <ctime>
+#include <fnmatch.h>
+#include <regex>
+#include <set>
+#include <sstream>
+#include <new>
+#include <fenv.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#endif
+#if defined(__SSE2__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+#if __cplusplus >= 201703L && defined(__has_include)
+#if __has_include(<charconv>)
+#include <charconv>
+#endif
+#endif
+#if defined(__cpp_lib_to_chars) && __cpp_lib_to_chars >= 201611L
+#define TESTBED_TO_CHARS
+#endif
+#ifdef USE_MPI
+#include <mpi.h>
+#endif
 
 #define PASTE(x, y) x ## y
 #define REGISTER(x) static testbed::Registrar<test_entity_ ## x> registrar_ ## x( # x)
 /**<Expands out the correct syntax for registering function with testbed*/
+#define REGISTER_BENCH(x) static testbed::BenchRegistrar<test_entity_ ## x> registrar_ ## x( # x)
+/**<As REGISTER, for a class derived from testbed::benchmark_entity. Benchmarks get the tag "benchmark"*/
+#define REGISTER_TAGGED(x, tags) static testbed::Registrar<test_entity_ ## x> registrar_ ## x( # x, false, tags)
+/**<As REGISTER, with a comma-separated list of tags for selecting tests, e.g. REGISTER_TAGGED(name, "fast,io")*/
+#define REGISTER_FIXTURE(x) static testbed::FixtureRegistrar<fixture_ ## x> fixture_registrar_ ## x( # x)
+/**<Registers class fixture_x, derived from testbed::fixture, as shared fixture x*/
 //When this breaks, google "most vexing parse"
 
 
@@ -125,7 +213,13 @@ namespace testbed{
   const int TEST_USERDEF_ERR2 = 64;
   const int TEST_USERDEF_ERR3 = 128;
   const int TEST_USERDEF_ERR4 = 256;
-  const int max_err = 10;
+  const int TEST_TIMEOUT = 512;
+  const int TEST_PERF_REGRESSION = 1024;
+  const int TEST_MEMORY = 2048;
+  const int TEST_FP_EXCEPTION = 4096;
+  const int TEST_DENORMAL = 8192;
+  const int max_user_err = 10;/**< \internal One past the index of the last user-definable code*/
+  const int max_err = 15;
   /* Error codes list */
 
   const double PRECISION = 1e-10;/**< Constant for equality at normal precision i.e. from rounding errors etc*/
@@ -136,7 +230,32 @@ namespace testbed{
   typedef int TEST_ERR;/**< Type for error codes*/
   typedef const int USER_ERR; /**<Special type for defining a new error code */
 
-  const int err_codes[max_err] ={TEST_PASSED, TEST_WRONG_RESULT, TEST_NULL_RESULT, TEST_ASSERT_FAIL, TEST_OTHER, TEST_USER_FAILED, TEST_USERDEF_ERR1, TEST_USERDEF_ERR2, TEST_USERDEF_ERR3, TEST_USERDEF_ERR4};/**< List of error codes available*/
+  const int err_codes[max_err] ={TEST_PASSED, TEST_WRONG_RESULT, TEST_NULL_RESULT, TEST_ASSERT_FAIL, TEST_OTHER, TEST_USER_FAILED, TEST_USERDEF_ERR1, TEST_USERDEF_ERR2, TEST_USERDEF_ERR3, TEST_USERDEF_ERR4, TEST_TIMEOUT, TEST_PERF_REGRESSION, TEST_MEMORY, TEST_FP_EXCEPTION, TEST_DENORMAL};/**< List of error codes available*/
+
+  const int SCHEDULE_ADDED = 0;/**< Run tests in the order added*/
+  const int SCHEDULE_LONGEST_FIRST = 1;/**< Run tests which took longest last time first*/
+  const int SCHEDULE_FAILED_FIRST = 2;/**< Run tests which failed last time first, then longest first*/
+  /* Scheduling policies for set_schedule*/
+
+  const int FP_CHECK_OFF = 0;/**< Don't look at floating-point exceptions*/
+  const int FP_CHECK_WARN = 1;/**< Warn of invalid operations, division by zero, overflow and denormal operands*/
+  const int FP_CHECK_FAIL = 2;/**< Also fail tests with TEST_FP_EXCEPTION for invalid operations or division by zero, and TEST_DENORMAL for denormal operands*/
+  const int FP_CHECK_TRAP = 3;/**< Also trap invalid operations and division by zero where they happen, with SIGFPE*/
+  /* Floating-point checking modes for set_fp_checks*/
+
+  struct test_selection{
+    std::vector<std::string> include;/**< Name patterns to run, or empty for all. Shell-style globs, or regular expressions if starting re:*/
+    std::vector<std::string> exclude;/**< Name patterns not to run*/
+    std::vector<std::string> tags;/**< Run only tests with one of these tags, or empty for any*/
+    std::vector<std::string> exclude_tags;/**< Don't run tests with any of these tags*/
+    int shard = 1;/**< Which shard to run, from 1 to n_shards*/
+    int n_shards = 1;/**< Number of shards to split the selected tests into*/
+    bool list_only = false;/**< List the tests which would run, instead of running them*/
+  };
+  /**< \brief Which tests to run. @see set_selection
+  *
+  * Patterns match the names tests are registered under
+  */
 
   class config{
     public:
@@ -147,11 +266,41 @@ namespace testbed{
 
       mpi_info_struc mpi_info = mpi_info_null;
       /**< \internal Default MPI struct. This is null, i.e. does not distinguish between processors*/
+#ifdef USE_MPI
+      MPI_Comm mpi_comm = MPI_COMM_WORLD;/**< Communicator the testbed's own collectives use*/
+      bool mpi_reduce = false;/**< Whether to combine results from all ranks*/
+      int mpi_batch = 64;/**< Number of tests between result reductions*/
+      bool mpi_shard = false;/**< Whether to share independent tests among ranks*/
+#endif
       
       std::string filename = "tests.log";/**<Default test log file*/
       bool hasColour = false;/**< \internal Flag for terminal colour use*/
+      int n_threads = 1;/**< Number of threads used to run tests. 1 runs serially, in the calling thread*/
+      int n_slowest = 5;/**< Number of tests listed in the slowest tests table at end of run. 0 for none*/
+      bool async_log = false;/**< \internal Whether output goes via the background log_sink*/
+      int n_isolated = 0;/**< Number of worker processes for isolated running. 0 runs tests in this process*/
+      std::string junit_file = "";/**< JUnit XML results file, if any*/
+      std::string jsonl_file = "";/**< JSON Lines results file, if any*/
+      std::string trace_file = "";/**< Chrome trace timeline file, if any*/
+      double default_timeout = 0.0;/**< Time limit in s for tests which don't set their own. 0 for none*/
+      double suite_timeout = 0.0;/**< Time limit in s for a whole run_tests. 0 for none*/
+      size_t memory_budget = 0;/**< Peak heap in bytes for tests which don't set their own. 0 for none*/
+      bool perf_counters = false;/**< Whether to read CPU performance counters around each test*/
+      int fp_checks = FP_CHECK_OFF;/**< Floating-point exception checking mode*/
+      double roofline_bandwidth = 0.0;/**< Memory bandwidth to compare tests with, bytes/s, or 0 if unknown*/
+      double roofline_flops = 0.0;/**< Peak FLOP rate to compare tests with, FLOP/s, or 0 if unknown*/
+      std::string history_file = "";/**< Performance history file, if any*/
+      size_t history_window = 20;/**< Number of past runs in the performance baseline*/
+      double history_confidence = 0.99;/**< Confidence level for flagging a performance regression*/
+      double history_min_slowdown = 0.1;/**< Smallest fractional slowdown flagged as a regression*/
+      std::string revision = "";/**< Source revision recorded in the history. Empty to use $TESTBED_REVISION*/
+      test_selection selection;/**< Which tests to run*/
+      int schedule = SCHEDULE_ADDED;/**< Order to run tests in*/
+      bool fail_fast = false;/**< Whether to stop starting tests after the first failure*/
+      std::string golden_dir = "golden";/**< Directory holding golden reference files*/
+      bool regenerate_golden = false;/**< Whether test_entity::check_golden writes reference files instead of checking them*/
       int last_err = 6;
-      std::string err_names[max_err]={"None", "Wrong result", "Invalid Null result", "Assignment or assertion failed", "Other error", "Failed to allocate errorcode", "", "", "", ""};/**< Names corresponding to error codes, which are reported in log files*/
+      std::string err_names[max_err]={"None", "Wrong result", "Invalid Null result", "Assignment or assertion failed", "Other error", "Failed to allocate errorcode", "", "", "", "", "Timed out", "Performance regression", "Memory budget exceeded", "Floating-point exception", "Denormal operands"};/**< Names corresponding to error codes, which are reported in log files*/
       static config * instance(){static config inst; return &inst;}
   };
 
@@ -160,7 +309,7 @@ namespace testbed{
     *
     *Adds an error message to the defined set. There is a limited number (currently 4) of additional codes. @param text The printable message associated with this error @return The new error code, or if the maximum has been reached, a TEST_USER_FAILED error.
     */
-    if(config::instance()->last_err >= max_err-1) return TEST_USER_FAILED;
+    if(config::instance()->last_err >= max_user_err-1) return TEST_USER_FAILED;
     config::instance()->err_names[config::instance()->last_err] = text;
     config::instance()->last_err ++;
     return err_codes[config::instance()->last_err - 1];
@@ -173,6 +322,157 @@ namespace testbed{
   * Logging and print functions by default print only on the 0 ranked processor. Use this function to set the mpi_info for each processor. A testbed::mpi_info_struc has two fields, n_procs for the total number of processors, and rank, for each processor's rank.
   */
 
+  inline void set_parallelism(int n_threads){
+    /** \brief Run tests in parallel
+    *
+    * Sets the number of threads used by tests::run_tests. Default is 1, running each test in turn. 0 uses all available hardware threads. Tests are farmed out to a work-stealing pool, but their output is still logged in the order they were added, so the log and final count are unchanged. Tests which set test_entity::serial_only run alone.
+    */
+    if(n_threads <= 0) n_threads = std::max((int)std::thread::hardware_concurrency(), 1);
+    config::instance()->n_threads = n_threads;
+  }
+
+  inline void set_isolation(int n_workers){
+    /** \brief Run each test in a separate process
+    *
+    * With n_workers > 0, tests are run in forked worker processes, n_workers at once, which are sent tests and return results over pipes. A test which crashes or aborts takes down only its worker and is logged as TEST_OTHER with the signal, and a new worker carries on. Tests sharing global state can run side by side this way, even if they can't share threads. Output is logged in the usual order. 0 switches off. Uses fork, so POSIX only.
+    */
+    config::instance()->n_isolated = std::max(n_workers, 0);
+  }
+
+  inline std::string signal_name(int sig){
+    /** Name and description of a signal, e.g. SIGSEGV (Segmentation fault)*/
+    std::string name;
+    switch(sig){
+      case SIGSEGV: name = "SIGSEGV"; break;
+      case SIGABRT: name = "SIGABRT"; break;
+      case SIGFPE: name = "SIGFPE"; break;
+      case SIGBUS: name = "SIGBUS"; break;
+      case SIGILL: name = "SIGILL"; break;
+      case SIGKILL: name = "SIGKILL"; break;
+      case SIGTERM: name = "SIGTERM"; break;
+      case SIGINT: name = "SIGINT"; break;
+      default: name = "signal "+std::to_string(sig);
+    }
+    return name+" ("+strsignal(sig)+")";
+  }
+
+  inline bool read_all(int fd, void * data, size_t len){
+    /** \internal Read exactly len bytes from fd. False on end of file or error*/
+    char * pos = static_cast<char *>(data);
+    while(len > 0){
+      ssize_t n = read(fd, pos, len);
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0) return false;
+      pos += n;
+      len -= n;
+    }
+    return true;
+  }
+  inline bool write_all(int fd, const void * data, size_t len){
+    /** \internal Write exactly len bytes to fd. False on error*/
+    const char * pos = static_cast<const char *>(data);
+    while(len > 0){
+      ssize_t n = write(fd, pos, len);
+      if(n < 0 && errno == EINTR) continue;
+      if(n <= 0) return false;
+      pos += n;
+      len -= n;
+    }
+    return true;
+  }
+
+  inline void set_default_timeout(double seconds){config::instance()->default_timeout = std::max(seconds, 0.0);}
+  /**< \brief Set time limit for each test
+  *
+  * Applies to tests without their own test_entity::timeout. A test running over is logged with TEST_TIMEOUT as soon as it overruns, and asked to stop via test_entity::cancelled(). In isolated mode (set_isolation) its worker is killed instead. 0, the default, is no limit.
+  */
+  inline void set_suite_timeout(double seconds){config::instance()->suite_timeout = std::max(seconds, 0.0);}
+  /**< Set time limit for a whole tests::run_tests. Once over, running tests are timed out as for set_default_timeout, and any not yet started are logged with TEST_TIMEOUT without being run. 0, the default, is no limit*/
+
+  inline void set_memory_budget(size_t bytes){config::instance()->memory_budget = bytes;}
+  /**< Set peak heap use allowed in each test's run(), for tests without their own test_entity::memory_budget. A test going over fails with TEST_MEMORY. Only checked with TESTBED_MEMORY_HOOKS. 0, the default, is no limit*/
+
+  inline void set_perf_counters(bool on){config::instance()->perf_counters = on;}
+  /**< \brief Report CPU performance counters for each test
+  *
+  * Counts cycles, instructions, last-level cache misses and branch misses over each test's run() using Linux perf_event_open, and reports instructions per cycle and misses per thousand instructions at verbosity 2. Benchmarks also report counts per kernel call over their timed samples. Where hardware counters aren't allowed, e.g. in many containers (see /proc/sys/kernel/perf_event_paranoid), CPU time, page faults and context switches are reported instead. Only the thread calling run() is counted. Off by default
+  */
+
+  inline void set_fp_checks(int mode){config::instance()->fp_checks = std::max(FP_CHECK_OFF, std::min(mode, FP_CHECK_TRAP));}
+  /**< \brief Check floating-point exceptions in each test
+  *
+  * Clears the floating-point exception flags before each test's run() and reads them after. FP_CHECK_WARN reports invalid operations (which make NaNs), division by zero, overflow, and operations on denormal numbers, which can be many times slower. FP_CHECK_FAIL also fails the test, with TEST_FP_EXCEPTION or TEST_DENORMAL. FP_CHECK_TRAP instead raises SIGFPE at the invalid operation or division, to find it in a debugger or core dump. This kills the program, so use it with set_isolation, where it is logged as a crash. Denormal operands are only seen on x86, and trapping needs glibc. Only the thread calling run() is checked. Default FP_CHECK_OFF
+  */
+
+  inline void set_roofline(double bandwidth, double peak_flops){
+    config::instance()->roofline_bandwidth = std::max(bandwidth, 0.0);
+    config::instance()->roofline_flops = std::max(peak_flops, 0.0);
+  }
+  /**< Set memory bandwidth, in bytes/s, and peak FLOP rate, to compare tests declaring test_entity::bytes_moved or test_entity::flops with. Known figures, instead of measure_roofline. 0 for unknown, the default, when only the achieved rates are reported*/
+
+  inline void set_junit_file(std::string name){config::instance()->junit_file = name;}
+  /**< Also write results as JUnit XML to the named file, one testcase per test as it finishes. Must be set before tests::setup_tests. Empty for none, the default*/
+  inline void set_jsonl_file(std::string name){config::instance()->jsonl_file = name;}
+  /**< Also write results as JSON Lines to the named file, one object per test as it finishes. Must be set before tests::setup_tests. Empty for none, the default*/
+
+  inline void set_trace_file(std::string name){config::instance()->trace_file = name;}
+  /**< \brief Write a timeline of the run to the named file
+  *
+  * In Chrome trace format, for chrome://tracing or Perfetto. Each test is a span, with category its name, on a row per worker thread or process, and pid the MPI rank. Tests can add spans inside their own with trace_scope. Written by tests::cleanup_tests, gathering spans from all ranks to rank 0, so with MPI every rank must call it. Must be set before tests::setup_tests. Empty for none, the default
+  */
+
+  inline void set_history(std::string filename, int window=20, double confidence=0.99, double min_slowdown=0.1){
+    /** \brief Record performance history and flag regressions
+    *
+    * Each run_tests appends a record per test (name, source revision, host, time and outcome) to filename, which is only ever appended to. Each test's time is compared with the last window runs on this host that failed only through slowness, if there are at least 5. A time above the one-sided prediction interval at the given confidence, fitted to the log times, and also at least min_slowdown slower than the median, fails with TEST_PERF_REGRESSION. The time compared is wall time, or for benchmarks the median time per call. As slow runs count in the baseline, a deliberate slowdown stops failing after a while. Empty filename switches off. With MPI, rank 0 writes the file and every rank reads it, so ranks without access just don't check
+    */
+    config::instance()->history_file = filename;
+    config::instance()->history_window = std::max(window, 2);
+    config::instance()->history_confidence = std::min(std::max(confidence, 0.5), 1.0 - 1e-9);
+    config::instance()->history_min_slowdown = std::max(min_slowdown, 0.0);
+  }
+  inline void set_schedule(int policy){config::instance()->schedule = policy;}
+  /**< \brief Choose the order tests run in
+  *
+  * SCHEDULE_ADDED, the default, runs tests in the order they were added. SCHEDULE_LONGEST_FIRST runs the tests which took longest last time first, so a long test doesn't start last and hold up a parallel or sharded run. SCHEDULE_FAILED_FIRST runs tests which failed last time first, then longest first, for quick feedback when fixing a failure. Tests not in the history count as failed and longest, so run first. serial_only, and with set_mpi_shard collective, tests are still grouped together. Uses the last run on this host from the file set with set_history, and without that runs in the order added. Output is logged in the order run
+  */
+  inline void set_fail_fast(bool fail_fast){config::instance()->fail_fast = fail_fast;}
+  /**< \brief Stop at first failure
+  *
+  * With this on, once a test fails no more are started, and the rest are logged as not run. Tests already running finish. With MPI, needs set_mpi_reduce, and stops at the end of the batch with the failure, so all ranks stop together
+  */
+  inline void set_revision(std::string revision){config::instance()->revision = revision;}
+  /**< Set source revision recorded in the performance history. By default this is $TESTBED_REVISION, or failing that "unknown". The testbed doesn't run git itself, so a missing git or a build outside a repository can't slow or break a run. Build scripts can pass e.g. TESTBED_REVISION=$(git rev-parse --short HEAD)*/
+
+  inline void set_golden_dir(std::string dir){config::instance()->golden_dir = dir;}
+  /**< Set the directory test_entity::check_golden reads and writes reference files in. Default is "golden", relative to the working directory*/
+  inline void set_regenerate_golden(bool regenerate){config::instance()->regenerate_golden = regenerate;}
+  /**< \brief Regenerate golden reference files
+  *
+  * With this on, test_entity::check_golden writes the data it is given as the new reference, with the tolerance given, and passes. Use once to create the files, or after a deliberate change to the results. Default is off
+  */
+
+  inline void set_slowest_report(int n){config::instance()->n_slowest = std::max(n, 0);}
+  /**< Set how many tests are listed in the table of slowest tests printed at the end of tests::run_tests. Default is 5, 0 disables the table*/
+
+#ifdef USE_MPI
+  inline void set_mpi_comm(MPI_Comm comm){config::instance()->mpi_comm = comm;}
+  /**< Set the communicator used for the testbed's own collectives. Default is MPI_COMM_WORLD. It must match the ranks given to set_mpi*/
+  inline void set_mpi_reduce(bool reduce, int batch=64){
+    /** \brief Combine results from all ranks
+    *
+    * Normally each rank counts only its own failures, and only rank 0 prints. With this on, after each batch of tests the error codes of all ranks are combined by a single bitwise-or reduction. Rank 0 then reports which ranks failed which test, with which codes, and all ranks count any failure on any rank. Failure details are gathered only for batches with a failure. Every rank must run the same tests in the same order. Needs set_mpi.
+    */
+    config::instance()->mpi_reduce = reduce;
+    config::instance()->mpi_batch = std::max(batch, 1);
+  }
+  inline void set_mpi_shard(bool shard){config::instance()->mpi_shard = shard;}
+  /**< \brief Share independent tests among ranks
+  *
+  * Normally every rank runs every test. With this on, each test with test_entity::collective false is run by just one rank. Ranks take the next such test from a shared counter as they become free, so the load balances itself. Results and output are gathered back to rank 0 and logged in the usual order. Collective tests still run on every rank. Needs set_mpi and MPI-3 one-sided support.
+  */
+#endif
+
   inline void set_colour(std::string function, char colour){
     /** \brief Set colours used
     *
@@ -191,47 +491,378 @@ namespace testbed{
     }
   }
 
-  inline void my_print(std::string text, int rank_to_write=0, int rank=config::instance()->mpi_info.rank, bool noreturn=false){
+  class log_sink{
+  /** \internal \brief Asynchronous log writer
+  *
+  * my_print queues text into a bounded lock-free ring (D. Vyukov's MPMC queue) and a background thread writes it out in batches, flushing each stream once per batch instead of once per line. The writer sleeps on a condition variable when the ring is empty, and is woken by the next push. flush() waits until everything queued so far is written. Pending output is also written at exit, on std::terminate and on fatal signals, after which any handlers installed before ours are called. The signal handler only claims records from the ring and write()s them, which is async-signal safe. It can only write to std::cout and to streams given a file descriptor with set_emergency_fd. Text the writer has taken but not yet flushed is given a moment to land, but may be lost
+  */
+    struct record{
+      std::ostream * dest;
+      std::string text;
+    };
+    struct slot{
+      std::atomic<size_t> seq;
+      record rec;
+    };
+    static const size_t capacity = 4096;/**< Ring size, a power of 2*/
+    static const size_t max_batch = 1024;/**< Most records written between flushes*/
+
+    std::unique_ptr<slot[]> ring;
+    std::atomic<size_t> enqueue_pos, dequeue_pos;
+    std::atomic<size_t> n_written;/**< Records written and flushed*/
+    std::atomic<bool> running;
+    std::thread writer;
+    std::mutex write_lock;/**< Held while writing, so a synchronous drain can't interleave with the writer thread*/
+    std::mutex wake_lock;
+    std::condition_variable wake;/**< Wakes an idle writer*/
+    std::atomic<bool> idle;/**< Whether the writer is, or is about to be, asleep on wake*/
+    static const size_t max_fds = 8;
+    std::ostream * fd_streams[max_fds];/**< Streams the signal handler can write, as fd_numbers*/
+    std::atomic<int> fd_numbers[max_fds];
+    static const int n_fatal = 7;
+    struct sigaction old_actions[n_fatal];/**< Handlers we replaced, to chain to*/
+    std::terminate_handler old_terminate = nullptr;
+
+    pid_t owner;/**< Process which started the writer. A forked child has no writer thread, and must not touch it*/
+
+    log_sink() : ring(new slot[capacity]), enqueue_pos(0), dequeue_pos(0), n_written(0), running(false), idle(false), owner(getpid()){
+      for(size_t i=0; i< capacity; i++) ring[i].seq.store(i, std::memory_order_relaxed);
+      for(size_t i=0; i< max_fds; i++){
+        fd_streams[i] = nullptr;
+        fd_numbers[i].store(-1);
+      }
+    }
+    static const int * fatal_signals(){
+      static const int signals[n_fatal] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGTERM, SIGINT};
+      return signals;
+    }
+    static void at_exit(){instance()->stop();}
+
+    bool write_next(std::ostream *& dest){
+    /** Write out the oldest record, straight from its slot so the slot keeps its storage for reuse. False if there are none*/
+      size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+      for(;;){
+        slot & cell = ring[pos & (capacity-1)];
+        long diff = (long)cell.seq.load(std::memory_order_acquire) - (long)(pos+1);
+        if(diff == 0){
+          if(dequeue_pos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)){
+            dest = cell.rec.dest;
+            *dest<<cell.rec.text;
+            cell.seq.store(pos + capacity, std::memory_order_release);
+            return true;
+          }
+        }else if(diff < 0){
+          return false;//Empty
+        }else{
+          pos = dequeue_pos.load(std::memory_order_relaxed);
+        }
+      }
+    }
+    size_t drain(){
+    /** Write out up to max_batch records and flush the streams used. Call with write_lock held*/
+      std::ostream * dest;
+      size_t n_done = 0;
+      bool used_cout = false;
+      std::ostream * last_file = nullptr;
+      while(n_done < max_batch && write_next(dest)){
+        if(dest == &std::cout){
+          used_cout = true;
+        }else if(dest != last_file){
+          if(last_file) last_file->flush();
+          last_file = dest;
+        }
+        n_done++;
+      }
+      if(last_file) last_file->flush();
+      if(used_cout) std::cout.flush();
+      n_written += n_done;
+      return n_done;
+    }
+    bool pending(){
+    /** Whether the oldest record is ready to write*/
+      size_t pos = dequeue_pos.load();
+      return (long)ring[pos & (capacity-1)].seq.load(std::memory_order_acquire) - (long)(pos+1) >= 0;
+    }
+    void writer_loop(){
+      while(running.load()){
+        size_t n_done;
+        {
+          std::lock_guard<std::mutex> guard(write_lock);
+          n_done = drain();
+        }
+        if(n_done > 0) continue;
+        std::unique_lock<std::mutex> guard(wake_lock);
+        idle.store(true);
+        //Pairs with the fence in push: either we see its record, or it sees us idle and wakes us
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(pending() || !running.load()){
+          idle.store(false);
+          continue;
+        }
+        wake.wait(guard, [this](){return !idle.load();});
+      }
+    }
+    void wake_writer(){
+      std::lock_guard<std::mutex> guard(wake_lock);
+      idle.store(false);
+      wake.notify_one();
+    }
+
+    void signal_flush(){
+    /** \brief Write out pending records from a signal handler
+    *
+    * Only lock-free atomics, write() and clock_gettime are used. Records are claimed from the ring like the writer does, so none is written twice. Then the writer is given up to 0.2 s to flush what it had already taken
+    */
+      if(getpid() != owner) return;
+      size_t target = enqueue_pos.load(), n_done = 0;
+      size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+      while(pos < target){
+        slot & cell = ring[pos & (capacity-1)];
+        if((long)cell.seq.load(std::memory_order_acquire) - (long)(pos+1) != 0) break;
+        if(!dequeue_pos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) continue;
+        int fd = -1;
+        if(cell.rec.dest == &std::cout) fd = STDOUT_FILENO;
+        for(size_t i=0; i< max_fds && fd < 0; i++) if(fd_streams[i] == cell.rec.dest) fd = fd_numbers[i].load();
+        const char * text = cell.rec.text.data();
+        size_t left = cell.rec.text.size();
+        while(fd >= 0 && left > 0){
+          ssize_t n = write(fd, text, left);
+          if(n < 0 && errno == EINTR) continue;
+          if(n <= 0) break;
+          text += n;
+          left -= n;
+        }
+        cell.seq.store(pos + capacity, std::memory_order_release);
+        n_done++;
+        pos++;
+      }
+      struct timespec start, now;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+      do{
+        if(n_written.load() + n_done >= target) return;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+      }while(running.load() && (now.tv_sec - start.tv_sec)*1000000000L + (now.tv_nsec - start.tv_nsec) < 200000000L);
+    }
+    static void on_signal(int sig, siginfo_t * info, void * context){
+      log_sink * sink = instance();
+      sink->signal_flush();
+      //Chain to whatever handled this signal before us
+      for(int i=0; i< n_fatal; i++){
+        if(fatal_signals()[i] != sig) continue;
+        struct sigaction & old = sink->old_actions[i];
+        if(old.sa_flags & SA_SIGINFO){
+          if(old.sa_sigaction) old.sa_sigaction(sig, info, context);
+          return;
+        }
+        if(old.sa_handler == SIG_IGN) return;
+        if(old.sa_handler != SIG_DFL){
+          old.sa_handler(sig);
+          return;
+        }
+      }
+      //Default action: restore it and raise again, which takes effect once we return
+      struct sigaction action;
+      std::memset(&action, 0, sizeof(action));
+      action.sa_handler = SIG_DFL;
+      sigemptyset(&action.sa_mask);
+      sigaction(sig, &action, nullptr);
+      raise(sig);
+    }
+    static void on_terminate(){
+      log_sink * sink = instance();
+      sink->emergency_flush();
+      if(sink->old_terminate) sink->old_terminate();
+      std::abort();
+    }
+
+  public:
+    static log_sink * instance(){static log_sink * inst = new log_sink(); return inst;}
+    /**< Never destroyed, so the writer outlives other statics. It is stopped by an atexit hook*/
+
+    void push(std::ostream * dest, const std::string & text, bool newline){
+    /** Queue text, and optionally a newline, for writing. Blocks if the ring is full. Text is copied into the slot's own string, so once the ring has gone round, queueing allocates nothing*/
+      size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+      slot * cell;
+      for(;;){
+        cell = &ring[pos & (capacity-1)];
+        long diff = (long)cell->seq.load(std::memory_order_acquire) - (long)pos;
+        if(diff == 0){
+          if(enqueue_pos.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) break;
+        }else if(diff < 0){
+          //Full, wait for writer
+          std::this_thread::yield();
+          pos = enqueue_pos.load(std::memory_order_relaxed);
+        }else{
+          pos = enqueue_pos.load(std::memory_order_relaxed);
+        }
+      }
+      cell->rec.dest = dest;
+      cell->rec.text.assign(text);
+      if(newline) cell->rec.text += '\n';
+      cell->seq.store(pos+1, std::memory_order_release);
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if(idle.load(std::memory_order_relaxed)) wake_writer();
+    }
+    void set_emergency_fd(std::ostream * dest, int fd){
+    /** \brief Give a file descriptor to write dest's pending text to from a fatal signal handler
+    *
+    * fd should be open on the same file, for appending. The sink takes ownership, and closes it when replaced. Pass -1 to remove, e.g. before closing the stream
+    */
+      size_t i = 0;
+      while(i < max_fds && fd_streams[i] != dest) i++;
+      if(i == max_fds){
+        if(fd < 0) return;
+        for(i=0; i< max_fds && fd_streams[i] != nullptr; i++);
+        if(i == max_fds){
+          close(fd);
+          return;
+        }
+        fd_streams[i] = dest;
+      }
+      int old_fd = fd_numbers[i].exchange(fd);
+      if(old_fd >= 0) close(old_fd);
+    }
+
+    void start(){
+    /** Start writer thread and hook exit paths*/
+      if(running.load()) return;
+      running = true;
+      owner = getpid();
+      writer = std::thread(&log_sink::writer_loop, this);
+      static bool hooked = false;
+      if(hooked) return;
+      hooked = true;
+      std::atexit(at_exit);
+      old_terminate = std::set_terminate(on_terminate);
+      struct sigaction action;
+      std::memset(&action, 0, sizeof(action));
+      action.sa_sigaction = on_signal;
+      action.sa_flags = SA_SIGINFO;
+      sigemptyset(&action.sa_mask);
+      for(int i=0; i< n_fatal; i++) sigaction(fatal_signals()[i], &action, &old_actions[i]);
+    }
+    void hold(){write_lock.lock();}/**< Keep the writer thread off the streams until release, e.g. across a fork*/
+    void release(){write_lock.unlock();}
+    void stop(){
+    /** Write everything pending and stop writer thread*/
+      if(!running.load() || getpid() != owner) return;
+      flush();
+      running = false;
+      wake_writer();
+      writer.join();
+    }
+    void flush(){
+    /** Block until everything queued so far has been written and flushed*/
+      size_t target = enqueue_pos.load();
+      if(!running.load() || getpid() != owner){
+        std::lock_guard<std::mutex> guard(write_lock);
+        while(n_written.load() < target && drain() > 0);
+        return;
+      }
+      while(n_written.load() < target) std::this_thread::yield();
+    }
+    void emergency_flush(){
+    /** Write out pending records from a dying process. Gives writer thread a moment, then drains directly*/
+      if(getpid() != owner) return;
+      size_t target = enqueue_pos.load();
+      for(int i=0; i< 100 && running.load() && n_written.load() < target; i++) std::this_thread::sleep_for(std::chrono::milliseconds(2));
+      if(n_written.load() >= target) return;
+      bool locked = write_lock.try_lock();
+      //If we can't lock, the writer itself may have died holding it, so go ahead
+      while(drain() > 0);
+      if(locked) write_lock.unlock();
+    }
+  };
+
+  inline void set_async_log(bool async){
+    /** \brief Buffer output in a background thread
+    *
+    * When on, my_print (and so all test reporting) queues text for a background thread, which writes it in batches rather than flushing every line. Output is flushed on any test failure, on tests::cleanup_tests, and at exit, including abnormal exit. Off by default.
+    */
+    config::instance()->async_log = async;
+    if(async) log_sink::instance()->start();
+    else log_sink::instance()->stop();
+  }
+  inline void flush_log(){
+    /** Block until all output is written. Only needed if set_async_log is on*/
+    if(config::instance()->async_log) log_sink::instance()->flush();
+  }
+
+  inline void my_print(const std::string & text, int rank_to_write=0, int rank=config::instance()->mpi_info.rank, bool noreturn=false){
   /** \brief Write output
   *
   *MPI aware writing routine. Writes string text to stdout, only from processor with rank equal rank_to_write. This defaults to 0. If mpi_info has not been set, via set_mpi, ALL processors will print, in unspecified order.
   */
     if(rank == rank_to_write || rank_to_write == -1){
+      if(config::instance()->async_log){
+        log_sink::instance()->push(&std::cout, text, !noreturn);
+        return;
+      }
       std::cout<< text;
       if(!noreturn) std::cout<<std::endl;
 
     }
 
   }
-  inline void my_print(std::fstream * handle, std::string text, int rank_to_write=0, int rank=config::instance()->mpi_info.rank, bool noreturn=false){
+  inline void my_print(std::fstream * handle, const std::string & text, int rank_to_write=0, int rank=config::instance()->mpi_info.rank, bool noreturn=false){
   /** \brief Write output
   *
   *MPI aware writing routine. Writes string text to given file, only from processor with rank equal rank_to_write. This defaults to 0. If mpi_info has not been set, via set_mpi, ALL processors will print, in unspecified order.
   */
     if((rank == rank_to_write || rank_to_write == -1) && handle!=nullptr){
+      if(config::instance()->async_log){
+        log_sink::instance()->push(handle, text, !noreturn);
+        return;
+      }
       *handle<<text;
       if(!noreturn) *handle<<std::endl;
 
     }else if(rank == rank_to_write || rank_to_write == -1){
-      std::cout<<text;
-      if(!noreturn) std::cout<<std::endl;
+      my_print(text, rank_to_write, rank, noreturn);
     }
   }
 
+  const int num_buffer_len = 330;/**< \internal Stack buffer length which fits any double, even in fixed form*/
+
+  inline char * format_number(char * first, char * last, double value, bool noexp=false){
+  /** \internal Write value into [first, last) as printf's %e, or %f if noexp. Returns end of written text. Uses std::to_chars where available*/
+#ifdef TESTBED_TO_CHARS
+    std::to_chars_result res = std::to_chars(first, last, value, noexp ? std::chars_format::fixed : std::chars_format::scientific, 6);
+    return (res.ec == std::errc()) ? res.ptr : first;
+#else
+    int n = std::snprintf(first, last-first, noexp ? "%f" : "%e", value);
+    return first + std::max(0, std::min(n, (int)(last-first)-1));
+#endif
+  }
+  template <typename T> char * format_integer(char * first, char * last, T value){
+  /** \internal Write integer value into [first, last). Returns end of written text*/
+#ifdef TESTBED_TO_CHARS
+    std::to_chars_result res = std::to_chars(first, last, value);
+    return (res.ec == std::errc()) ? res.ptr : first;
+#else
+    int n = std::is_signed<T>::value ? std::snprintf(first, last-first, "%lld", (long long)value) : std::snprintf(first, last-first, "%llu", (unsigned long long)value);
+    return first + std::max(0, std::min(n, (int)(last-first)-1));
+#endif
+  }
+
+  template <typename T> std::string mk_str(T input, std::true_type){
+    char buffer[num_buffer_len];
+    return std::string(buffer, format_integer(buffer, buffer+num_buffer_len, input));
+  }
+  template <typename T> std::string mk_str(T input, std::false_type){
+    char buffer[num_buffer_len];
+    return std::string(buffer, format_number(buffer, buffer+num_buffer_len, (double) input));
+  }
   template <typename T> std::string mk_str(T input){
-    return std::to_string(input);
+    return mk_str(input, std::is_integral<T>());
   }
-  /* Wrap C++11 to_string to be consistent with our overloaded mk_str*/
+  /* Numbers are formatted on the stack, by format_integer or format_number, so mk_str and info_stream give the same text for any type*/
 
   /**< Make string from input. Note has overloads where one can specify noexp=true to prevent using scientific form output*/
 
   inline std::string mk_str(double i, bool noexp=0){
-    char buffer[25];
-    if(noexp) std::snprintf(buffer, 25, "%f", i);
-    else std::snprintf(buffer, 25, "%e", i);
-    std::string ret = buffer;
-    return ret;
-    
+    char buffer[num_buffer_len];
+    return std::string(buffer, format_number(buffer, buffer+num_buffer_len, i, noexp));
   }
   inline std::string mk_str(bool b){
     if(b) return "1";
@@ -242,6 +873,352 @@ namespace testbed{
   inline std::string mk_str(float i, bool noexp){return mk_str((double) i, noexp);}
   /* Some overloads to mk_str for non-scientific output, and for bool type*/
 
+  const int TOL_ABSOLUTE = 0;/**< Compare absolute difference*/
+  const int TOL_RELATIVE = 1;/**< Compare difference relative to the larger magnitude*/
+  const int TOL_ULP = 2;/**< Compare distance in units in the last place*/
+  /* Tolerance types for compare_arrays*/
+
+  struct array_mismatch{
+    size_t index;
+    double result;
+    double expected;
+    double error;
+  };
+  /**< An element out of tolerance*/
+
+  struct compare_summary{
+    size_t n = 0;/**< Number of elements compared*/
+    size_t n_over = 0;/**< Number out of tolerance, including NaNs*/
+    double max_err = 0.0;/**< Largest error, in the tolerance type's units. Infinite if there is a NaN*/
+    size_t max_index = 0;/**< Index of first element with the largest error*/
+    std::vector<array_mismatch> mismatches;/**< The first few elements out of tolerance*/
+    bool passed() const {return n_over == 0;}
+    TEST_ERR err() const {return passed() ? TEST_PASSED : TEST_WRONG_RESULT;}/**< Error code to report*/
+  };
+  /**< Result of compare_arrays*/
+
+  inline double element_error(double result, double expected, int tol_type){
+  /** \internal Error between two elements, in the units of tol_type. NaN gives infinity
+  *
+  * Raises no floating-point exceptions for NaN or infinite input, which set_fp_checks would otherwise blame on the test: NaNs are caught before any ordered comparison, and unequal infinities before inf-inf or inf/inf
+  */
+    if(std::isnan(result) || std::isnan(expected)) return std::numeric_limits<double>::infinity();
+    if(result == expected) return 0.0;
+    if(tol_type != TOL_ULP && (std::isinf(result) || std::isinf(expected))) return std::numeric_limits<double>::infinity();
+    double err;
+    if(tol_type == TOL_ULP){
+      //Map bit patterns onto integers ordered like the doubles they represent
+      int64_t ia, ib;
+      std::memcpy(&ia, &result, sizeof(double));
+      std::memcpy(&ib, &expected, sizeof(double));
+      if(ia < 0) ia = std::numeric_limits<int64_t>::min() - ia;
+      if(ib < 0) ib = std::numeric_limits<int64_t>::min() - ib;
+      err = (ia > ib) ? (double)((uint64_t)ia - (uint64_t)ib) : (double)((uint64_t)ib - (uint64_t)ia);
+    }else{
+      err = std::abs(result - expected);
+      if(tol_type == TOL_RELATIVE) err /= std::max(std::abs(result), std::abs(expected));
+    }
+    return err;
+  }
+
+  inline void compare_block(const double * result, const double * expected, size_t n, double tol, int tol_type, double & block_max, size_t & block_over){
+  /** \internal \brief Max error and count out of tolerance over a short block
+  *
+  * Absolute and relative tolerances use SSE2 or AVX if the compiler targets them. ULP distance needs 64-bit integer compares, so is scalar. As for element_error, NaN and infinite input raise no floating-point exceptions: lanes which are equal, NaN or infinite are zeroed before the arithmetic, and given their error after, and ordered compares only see NaN-free values
+  */
+    size_t i = 0;
+    block_max = 0.0;
+    block_over = 0;
+    if(tol_type != TOL_ULP){
+      bool relative = (tol_type == TOL_RELATIVE);
+#if defined(__AVX__)
+      const __m256d sign = _mm256_set1_pd(-0.0), inf = _mm256_set1_pd(std::numeric_limits<double>::infinity()), one = _mm256_set1_pd(1.0), vtol = _mm256_set1_pd(tol);
+      __m256d vmax = _mm256_setzero_pd();
+      for(; i+4 <= n; i+=4){
+        __m256d va = _mm256_loadu_pd(result+i), vb = _mm256_loadu_pd(expected+i);
+        __m256d abs_a = _mm256_andnot_pd(sign, va), abs_b = _mm256_andnot_pd(sign, vb);
+        //Equal elements are exact, even if infinite or zero. Otherwise NaN or infinity counts as infinitely wrong
+        __m256d equal = _mm256_cmp_pd(va, vb, _CMP_EQ_OQ);
+        __m256d finite = _mm256_and_pd(_mm256_cmp_pd(abs_a, inf, _CMP_LT_OQ), _mm256_cmp_pd(abs_b, inf, _CMP_LT_OQ));
+        __m256d usable = _mm256_andnot_pd(equal, finite);
+        abs_a = _mm256_and_pd(usable, abs_a);
+        abs_b = _mm256_and_pd(usable, abs_b);
+        __m256d err = _mm256_andnot_pd(sign, _mm256_sub_pd(_mm256_and_pd(usable, va), _mm256_and_pd(usable, vb)));
+        if(relative) err = _mm256_div_pd(err, _mm256_or_pd(_mm256_max_pd(abs_a, abs_b), _mm256_andnot_pd(usable, one)));
+        err = _mm256_or_pd(_mm256_and_pd(usable, err), _mm256_andnot_pd(_mm256_or_pd(usable, equal), inf));
+        block_over += __builtin_popcount(_mm256_movemask_pd(_mm256_cmp_pd(err, vtol, _CMP_GT_OQ)));
+        vmax = _mm256_max_pd(vmax, err);
+      }
+      double lanes[4];
+      _mm256_storeu_pd(lanes, vmax);
+      block_max = std::max(std::max(lanes[0], lanes[1]), std::max(lanes[2], lanes[3]));
+#elif defined(__SSE2__)
+      const __m128d sign = _mm_set1_pd(-0.0), inf = _mm_set1_pd(std::numeric_limits<double>::infinity()), one = _mm_set1_pd(1.0), vtol = _mm_set1_pd(tol);
+      __m128d vmax = _mm_setzero_pd();
+      for(; i+2 <= n; i+=2){
+        __m128d va = _mm_loadu_pd(result+i), vb = _mm_loadu_pd(expected+i);
+        __m128d abs_a = _mm_andnot_pd(sign, va), abs_b = _mm_andnot_pd(sign, vb);
+        //Equal elements are exact, even if infinite or zero. Otherwise NaN or infinity counts as infinitely wrong. SSE2's only quiet compares are (un)ordered and (not) equal
+        __m128d equal = _mm_cmpeq_pd(va, vb);
+        __m128d finite = _mm_and_pd(_mm_and_pd(_mm_cmpord_pd(va, vb), _mm_cmpneq_pd(abs_a, inf)), _mm_cmpneq_pd(abs_b, inf));
+        __m128d usable = _mm_andnot_pd(equal, finite);
+        abs_a = _mm_and_pd(usable, abs_a);
+        abs_b = _mm_and_pd(usable, abs_b);
+        __m128d err = _mm_andnot_pd(sign, _mm_sub_pd(_mm_and_pd(usable, va), _mm_and_pd(usable, vb)));
+        if(relative) err = _mm_div_pd(err, _mm_or_pd(_mm_max_pd(abs_a, abs_b), _mm_andnot_pd(usable, one)));
+        err = _mm_or_pd(_mm_and_pd(usable, err), _mm_andnot_pd(_mm_or_pd(usable, equal), inf));
+        //err is NaN-free, so the signalling greater-than is safe
+        int over = _mm_movemask_pd(_mm_cmpgt_pd(err, vtol));
+        block_over += (over & 1) + (over >> 1);
+        vmax = _mm_max_pd(vmax, err);
+      }
+      double lanes[2];
+      _mm_storeu_pd(lanes, vmax);
+      block_max = std::max(lanes[0], lanes[1]);
+#endif
+    }
+    for(; i< n; i++){
+      double err = element_error(result[i], expected[i], tol_type);
+      block_max = std::max(block_max, err);
+      if(std::isgreater(err, tol)) block_over++;
+    }
+  }
+
+  inline compare_summary compare_range(const double * result, const double * expected, size_t begin, size_t end, double tol, int tol_type, size_t max_reported){
+  /** \internal Compare elements [begin, end) a block at a time. Blocks are only rescanned element by element for their maximum or mismatches if needed*/
+    const size_t block_len = 512;
+    compare_summary summary;
+    summary.n = end - begin;
+    summary.max_index = begin;
+    for(size_t start=begin; start< end; start+=block_len){
+      size_t len = std::min(block_len, end-start);
+      double block_max;
+      size_t block_over;
+      compare_block(result+start, expected+start, len, tol, tol_type, block_max, block_over);
+      summary.n_over += block_over;
+      bool new_max = block_max > summary.max_err;
+      bool want_mismatches = block_over > 0 && summary.mismatches.size() < max_reported;
+      if(!new_max && !want_mismatches) continue;
+      for(size_t i=start; i< start+len; i++){
+        double err = element_error(result[i], expected[i], tol_type);
+        if(err > summary.max_err){
+          summary.max_err = err;
+          summary.max_index = i;
+        }
+        if(err > tol && summary.mismatches.size() < max_reported){
+          array_mismatch mismatch = {i, result[i], expected[i], err};
+          summary.mismatches.push_back(mismatch);
+        }
+      }
+    }
+    return summary;
+  }
+
+  inline void merge_summary(compare_summary & summary, const compare_summary & part, size_t max_reported){
+  /** \internal Add the summary of a later range of elements onto summary*/
+    summary.n += part.n;
+    summary.n_over += part.n_over;
+    if(part.max_err > summary.max_err){
+      summary.max_err = part.max_err;
+      summary.max_index = part.max_index;
+    }
+    for(size_t i=0; i< part.mismatches.size() && summary.mismatches.size() < max_reported; i++) summary.mismatches.push_back(part.mismatches[i]);
+  }
+
+  inline compare_summary compare_arrays(const double * result, const double * expected, size_t n, double tol=PRECISION, int tol_type=TOL_RELATIVE, size_t max_reported=10, int n_threads=1){
+  /** \brief Compare arrays element-wise to a tolerance
+  *
+  * Checks each result[i] is within tol of expected[i]. tol_type is TOL_ABSOLUTE, TOL_RELATIVE (to the larger magnitude) or TOL_ULP, where tol is a number of units in the last place. For the first two, PRECISION, NUM_PRECISION and LOW_PRECISION give standard tiers. NaNs never match. Returns the number out of tolerance, the largest error and where it is, and the first max_reported mismatches. The bulk of the work is vectorised. For large arrays, n_threads > 1 splits the work among threads, and 0 uses all hardware threads. See mk_str(const compare_summary &) for a printable summary.
+  */
+    if(n_threads <= 0) n_threads = std::max((int)std::thread::hardware_concurrency(), 1);
+    //Threads are only worthwhile for big arrays
+    const size_t min_per_thread = 1 << 18;
+    n_threads = (int)std::max((size_t)1, std::min((size_t)n_threads, n/min_per_thread));
+    if(n_threads == 1) return compare_range(result, expected, 0, n, tol, tol_type, max_reported);
+
+    std::vector<compare_summary> parts(n_threads);
+    std::vector<std::thread> threads;
+    size_t chunk = (n + n_threads - 1)/n_threads;
+    for(int t=0; t< n_threads; t++){
+      size_t begin = std::min(t*chunk, n), end = std::min(begin+chunk, n);
+      threads.push_back(std::thread([&parts, t, result, expected, begin, end, tol, tol_type, max_reported](){parts[t] = compare_range(result, expected, begin, end, tol, tol_type, max_reported);}));
+    }
+    for(size_t t=0; t< threads.size(); t++) threads[t].join();
+    //Parts are in index order, so merging keeps the first max and first mismatches
+    compare_summary summary = parts[0];
+    for(size_t t=1; t< parts.size(); t++) merge_summary(summary, parts[t], max_reported);
+    return summary;
+  }
+  inline compare_summary compare_arrays(const std::vector<double> & result, const std::vector<double> & expected, double tol=PRECISION, int tol_type=TOL_RELATIVE, size_t max_reported=10, int n_threads=1){
+  /** \copydoc compare_arrays. Vectors of different lengths compare only the common part, with the excess counted as mismatches*/
+    size_t n = std::min(result.size(), expected.size());
+    compare_summary summary = compare_arrays(result.data(), expected.data(), n, tol, tol_type, max_reported, n_threads);
+    size_t excess = std::max(result.size(), expected.size()) - n;
+    summary.n += excess;
+    summary.n_over += excess;
+    if(excess > 0) summary.max_err = std::numeric_limits<double>::infinity();
+    return summary;
+  }
+
+  inline std::string mk_str(const compare_summary & summary){
+    /** Printable form of compare_summary, for report_info*/
+    if(summary.passed()) return "All "+mk_str(summary.n)+" values within tolerance, max error "+mk_str(summary.max_err);
+    std::string text = mk_str(summary.n_over)+" of "+mk_str(summary.n)+" values out of tolerance, max error "+mk_str(summary.max_err)+" at index "+mk_str(summary.max_index);
+    if(!summary.mismatches.empty()) text += ". First mismatches:";
+    for(size_t i=0; i< summary.mismatches.size(); i++){
+      const array_mismatch & mismatch = summary.mismatches[i];
+      text += " ["+mk_str(mismatch.index)+"] "+mk_str(mismatch.result)+" vs "+mk_str(mismatch.expected)+(i+1 < summary.mismatches.size() ? ",": "");
+    }
+    return text;
+  }
+
+
+  const int GOLDEN_DOUBLE = 1;/**< Golden file element type for double*/
+  const size_t golden_max_dims = 4;/**< Most dimensions a golden file can have*/
+  const size_t golden_data_offset = 128;/**< \internal Data starts here in a golden file, so it is aligned in the mapping*/
+
+  struct golden_header{
+    char magic[8];/**< "TBGOLD" plus two digit format version*/
+    uint32_t dtype;/**< Element type, GOLDEN_DOUBLE*/
+    uint32_t ndim;/**< Number of dimensions used in shape*/
+    uint64_t shape[golden_max_dims];/**< Extent of each dimension, slowest varying first*/
+    uint32_t tol_type;/**< Tolerance type to compare with, as for compare_arrays*/
+    uint32_t reserved;
+    double tolerance;/**< Tolerance to compare with*/
+    uint64_t checksum;/**< golden_checksum of the data*/
+  };
+  /**< \brief Header of a golden reference file
+  *
+  * Stored in native byte order, followed by padding up to golden_data_offset and then the elements. Files are not portable between machines of different endianness
+  */
+  static_assert(sizeof(golden_header) <= golden_data_offset, "Golden header overlaps data");
+  const char golden_magic[8] = {'T', 'B', 'G', 'O', 'L', 'D', '0', '1'};/**< \internal Identifies a golden file and its version*/
+
+  inline uint64_t golden_checksum(const double * data, size_t n, uint64_t hash=14695981039346656037ULL){
+  /** \brief Checksum of golden data
+  *
+  * FNV-1a over 64-bit words, so one multiply per element. Pass the result back in as hash to continue over the next part of an array
+  */
+    for(size_t i=0; i< n; i++){
+      uint64_t word;
+      std::memcpy(&word, data+i, sizeof(uint64_t));
+      hash = (hash ^ word) * 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  class golden_file{
+  /** \brief Read-only memory mapping of a golden reference file
+  *
+  * The header is checked on opening, but the data is only paged in as it is read, so large references cost no copy and little memory. Check ok() before use, and error() says why not
+  */
+    int fd = -1;
+    void * map = MAP_FAILED;
+    size_t map_len = 0;
+    std::string error_text;
+  public:
+    golden_header header;/**< Copy of the file header*/
+    explicit golden_file(const std::string & filename){
+      std::memset(&header, 0, sizeof(golden_header));
+      fd = open(filename.c_str(), O_RDONLY);
+      if(fd < 0){
+        error_text = "Cannot open golden file "+filename+": "+strerror(errno);
+        return;
+      }
+      struct stat info;
+      if(fstat(fd, &info) != 0 || (size_t)info.st_size < golden_data_offset){
+        error_text = "Golden file "+filename+" is too short";
+        return;
+      }
+      map_len = info.st_size;
+      map = mmap(nullptr, map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(map == MAP_FAILED){
+        error_text = "Cannot map golden file "+filename+": "+strerror(errno);
+        return;
+      }
+      //Data is read front to back, once
+      madvise(map, map_len, MADV_SEQUENTIAL);
+      std::memcpy(&header, map, sizeof(golden_header));
+      if(std::memcmp(header.magic, golden_magic, sizeof(golden_magic)) != 0){
+        error_text = "File "+filename+" is not a golden file, or is an unsupported version";
+      }else if(header.dtype != GOLDEN_DOUBLE){
+        error_text = "Golden file "+filename+" has unsupported element type "+std::to_string(header.dtype);
+      }else if(header.ndim < 1 || header.ndim > golden_max_dims){
+        error_text = "Golden file "+filename+" has invalid number of dimensions "+std::to_string(header.ndim);
+      }else if(golden_data_offset + size()*sizeof(double) != map_len){
+        error_text = "Golden file "+filename+" is truncated, or its shape is wrong";
+      }
+    }
+    golden_file(const golden_file &) = delete;
+    golden_file & operator=(const golden_file &) = delete;
+    ~golden_file(){
+      if(map != MAP_FAILED) munmap(map, map_len);
+      if(fd >= 0) close(fd);
+    }
+    bool ok() const {return error_text.empty();}
+    const std::string & error() const {return error_text;}/**< Why the file can't be used*/
+    size_t size() const {
+      /** Number of elements*/
+      size_t n = 1;
+      for(size_t i=0; i< header.ndim && i< golden_max_dims; i++) n *= header.shape[i];
+      return n;
+    }
+    std::vector<size_t> shape() const {return std::vector<size_t>(header.shape, header.shape+std::min((size_t)header.ndim, golden_max_dims));}
+    const double * data() const {return reinterpret_cast<const double *>(static_cast<const char *>(map) + golden_data_offset);}/**< Elements, directly from the mapping*/
+  };
+
+  inline bool write_golden(const std::string & filename, const double * data, const std::vector<size_t> & shape, double tol=PRECISION, int tol_type=TOL_RELATIVE){
+  /** \brief Write a golden reference file
+  *
+  * Writes n elements of data, where n is the product of shape, with the tolerance to check them to. Writes to a temporary file and then renames, so a reader never sees a partial file. Returns false on failure
+  */
+    if(shape.empty() || shape.size() > golden_max_dims) return false;
+    golden_header header;
+    std::memset(&header, 0, sizeof(golden_header));
+    std::memcpy(header.magic, golden_magic, sizeof(golden_magic));
+    header.dtype = GOLDEN_DOUBLE;
+    header.ndim = shape.size();
+    size_t n = 1;
+    for(size_t i=0; i< shape.size(); i++){
+      header.shape[i] = shape[i];
+      n *= shape[i];
+    }
+    header.tol_type = tol_type;
+    header.tolerance = tol;
+    header.checksum = golden_checksum(data, n);
+
+    std::string tmp_name = filename+".tmp";
+    std::ofstream file(tmp_name.c_str(), std::ios::binary | std::ios::trunc);
+    char padding[golden_data_offset] = {0};
+    file.write(reinterpret_cast<const char *>(&header), sizeof(golden_header));
+    file.write(padding, golden_data_offset - sizeof(golden_header));
+    file.write(reinterpret_cast<const char *>(data), n*sizeof(double));
+    file.close();
+    if(!file || std::rename(tmp_name.c_str(), filename.c_str()) != 0){
+      std::remove(tmp_name.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  inline compare_summary compare_golden(const golden_file & golden, const double * result, bool & intact, size_t max_reported=10){
+  /** \brief Compare result against a golden file
+  *
+  * result must have golden.size() elements. Compares to the tolerance stored in the file, streaming over the mapping a chunk at a time. Each chunk is checksummed while it is in cache, and intact is set false if the reference data doesn't match its checksum
+  */
+    const size_t chunk = 1 << 15;
+    const double * expected = golden.data();
+    size_t n = golden.size();
+    uint64_t hash = golden_checksum(nullptr, 0);
+    compare_summary summary;
+    for(size_t start=0; start< n; start+=chunk){
+      size_t end = std::min(start+chunk, n);
+      hash = golden_checksum(expected+start, end-start, hash);
+      merge_summary(summary, compare_range(result, expected, start, end, golden.header.tolerance, golden.header.tol_type, max_reported), max_reported);
+    }
+    intact = (hash == golden.header.checksum);
+    return summary;
+  }
 
   inline void check_term(){
     /** \brief Check terminal capabilites
@@ -256,78 +1233,1565 @@ namespace testbed{
   }
 
 
+  struct test_timing{
+    double wall = 0.0;/**< Wall-clock time in s*/
+    double user = 0.0;/**< User CPU time in s*/
+    double sys = 0.0;/**< System CPU time in s*/
+    long rss_kb = 0;/**< Growth in process peak resident set, in kB*/
+  };
+  /**< Resources used by one test*/
+
   class tests;
 
+  class fixture{
+  /** \brief Shared suite fixture
+  *
+  * Base for expensive setup shared by several tests, e.g. a big mesh or data set. Derive from this, do the setup in the constructor and cleanup in the destructor, and register with REGISTER_FIXTURE. Tests get it with test_entity::get_fixture, which builds it on first use. It is shared between tests, including ones running at the same time, so must be read-only once built.
+  */
+  public:
+    virtual ~fixture(){;}
+  };
+
   /**\brief Testing instance
   *
   *Consists of at least a constructor doing any setup required, a name string for output id, a function run() taking no parameters which performs the necessary test and a destructor doing cleanup. Ant additional methods may be included. In particular, setup methods with any signature can be run when adding tests. See tests:add
+  *
+  *Each test is constructed twice: once when added, with any setup function applied, to read its name and flags, being destroyed at once, and again, with setup applied again, just before it runs, being destroyed straight after. So only the tests running at the moment are alive, but constructors and setup functions must be cheap and safe to repeat, with big allocations in run() or a shared fixture
   */
   class test_entity{
   private:
   public:
 
     tests * parent;/** \internal Parent tests object, for error reporting etc */
+    int id;/** \internal Position in parent's test list, so reports are attributed correctly when tests run in parallel */
     std::string name;/**< The name of the test, which will be reported in the log file*/
-    test_entity(){parent = nullptr; name = "";}
+    bool serial_only;/**< Set true in constructor if this test must not share the machine with other tests, e.g. because it is itself threaded*/
+    bool collective;/**< Set false in constructor if this test is purely serial, so with set_mpi_shard any one rank may run it*/
+    double timeout;/**< Time limit for run() in s, or 0 to use the default. @see set_default_timeout*/
+    size_t memory_budget;/**< Peak heap in bytes run() may use, or 0 to use the default. @see set_memory_budget*/
+    double bytes_moved;/**< Bytes run() reads and writes, or for a benchmark one kernel call, if known. Achieved bandwidth is then reported. May be set in run()*/
+    double flops;/**< Floating-point operations run() does, or for a benchmark one kernel call, if known. Achieved FLOP rate is then reported. May be set in run()*/
+    const std::atomic<bool> * cancel_flag;/** \internal Set by the runner when this test has overrun*/
+    test_entity(){parent = nullptr; id = -1; name = ""; serial_only = false; collective = true; timeout = 0.0; memory_budget = 0; bytes_moved = 0.0; flops = 0.0; cancel_flag = nullptr;}
+    bool cancelled() const {return cancel_flag && cancel_flag->load(std::memory_order_relaxed);}/**< Whether the test has overrun its time limit. Long-running tests should check this now and then, and return promptly if true*/
     virtual ~test_entity(){;}
     virtual TEST_ERR run()=0;/**< Run method must have this signature. \internal Pure virtual because we don't want an instances of this template*/
     void report_info(std::string info, int verb_to_print =1);
+    class info_stream report_info(int verb_to_print);
     void report_err(TEST_ERR err);
+    virtual double performance_measure(const test_timing & timing) const {return timing.wall;}/**< Time in s compared with history to detect regressions. @see set_history*/
+    std::vector<std::string> fixtures;/**< \internal Names of fixtures this test has declared it uses*/
+    void uses_fixture(const std::string & name){fixtures.push_back(name);}/**< Declare, in the constructor, that run() uses the named fixture, so it can be freed once all its users are done*/
+    template <typename T> const T * get_fixture(const std::string & name);
+    TEST_ERR check_golden(const std::string & ref_name, const double * data, const std::vector<size_t> & shape, double tol=PRECISION, int tol_type=TOL_RELATIVE);
+    TEST_ERR check_golden(const std::string & ref_name, const std::vector<double> & data, double tol=PRECISION, int tol_type=TOL_RELATIVE){return check_golden(ref_name, data.data(), std::vector<size_t>(1, data.size()), tol, tol_type);}
+    /**< \copydoc check_golden*/
 
   };
 
-  class test_factory{
-  /** \internal \brief Factory producing test instances
+  class info_stream{
+  /** \brief Deferred report_info message
   *
-  *Adapted from http://www.codeproject.com/Articles/567242/AplusC-b-bplusObjectplusFactory
+  * Returned by test_entity::report_info(int). Text streamed in with << is only formatted if the verbosity means it will be printed, so costs nothing otherwise. The message is reported when the stream goes out of scope, i.e. at the end of the statement.
   */
-  
-  friend class tests;
-  private:
-    std::map<std::string, std::function<test_entity*(void)> > factoryFunctionRegistry;
+    tests * parent;
+    int verb_to_print;
+    int test_id;
+    bool active;
+    std::string text;
+
+    void append(double value){
+      char buffer[num_buffer_len];
+      text.append(buffer, format_number(buffer, buffer+num_buffer_len, value));
+    }
+    template <typename T> void append(T value, std::true_type){
+      char buffer[num_buffer_len];
+      text.append(buffer, format_integer(buffer, buffer+num_buffer_len, value));
+    }
+    template <typename T> void append(T value, std::false_type){append((double) value);}
   public:
-    /** \internal Register a test_entity constructor*/
-    void registerFactoryFunction(std::string name, std::function<test_entity*(void)> classFactoryFunction){ factoryFunctionRegistry[name] = classFactoryFunction;}
-    static test_factory * instance();
-    std::shared_ptr<test_entity> create(std::string name);
+    info_stream(tests * parent, int verb_to_print, int test_id, bool active) : parent(parent), verb_to_print(verb_to_print), test_id(test_id), active(active){;}
+    info_stream(info_stream && other) : parent(other.parent), verb_to_print(other.verb_to_print), test_id(other.test_id), active(other.active), text(std::move(other.text)){other.active = false;}
+    info_stream(const info_stream &) = delete;
+    info_stream & operator=(const info_stream &) = delete;
+    ~info_stream();
 
+    info_stream & operator<<(const std::string & value){if(active) text += value; return *this;}
+    info_stream & operator<<(const char * value){if(active) text += value; return *this;}
+    info_stream & operator<<(char value){if(active) text += value; return *this;}
+    info_stream & operator<<(bool value){if(active) text += (value ? '1' : '0'); return *this;}
+    template <typename T> info_stream & operator<<(T value){
+      static_assert(std::is_arithmetic<T>::value, "Only strings and numbers can be streamed into report_info");
+      if(active) append(value, std::is_integral<T>());
+      return *this;
+    }
+    /**< Append to message. Numbers are formatted as by mk_str*/
   };
-  inline test_factory * test_factory::instance(){
-    /** \internal Return the factory singleton instance*/
-    static test_factory factory;
-    return &factory;
-  }
 
-  inline std::shared_ptr<test_entity> test_factory::create(std::string name){
-    /** \internal \brief Create test_entity
-    *
-    * Create an instance of a test_entity previously registered
-    */
-      test_entity * instance = nullptr;
-      // find name in the registry and call factory method.
-      auto it = this->factoryFunctionRegistry.find(name);
-      if(it != this->factoryFunctionRegistry.end())
-          instance = it->second();
-      // wrap instance in a shared ptr and return
-      if(instance != nullptr)
-          return std::shared_ptr<test_entity>(instance);
-      else
-          return nullptr;
+  template <typename T> inline void do_not_optimize(T const & value){
+  /** \brief Stop the compiler removing work
+  *
+  * Pretends to read value, so a computation whose result is passed here can't be optimised out of a benchmark kernel
+  */
+#if defined(__GNUC__)
+    __asm__ __volatile__("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void * sink;
+    sink = &value;
+#endif
   }
-  
-  template<class T>
+  inline void clobber_memory(){
+  /** \brief Stop the compiler removing or reordering memory writes
+  *
+  * Pretends all memory may be read and written here, so stores done by a benchmark kernel are not discarded
+  */
+#if defined(__GNUC__)
+    __asm__ __volatile__("" : : : "memory");
+#else
+    std::atomic_signal_fence(std::memory_order_seq_cst);
+#endif
+  }
+
+  inline void triad_kernel(double * a, const double * b, const double * c, double scalar, size_t n){
+    /** \internal STREAM triad*/
+    for(size_t i=0; i< n; i++) a[i] = b[i] + scalar*c[i];
+  }
+  const int fma_chains = 32;/**< \internal Independent multiply-add chains in fma_kernel, enough to hide latency on current CPUs*/
+  inline double fma_kernel(size_t n_iterations){
+    /** \internal Multiply-adds with no memory traffic. 2*fma_chains FLOPs per iteration*/
+    double acc[fma_chains];
+    for(int j=0; j< fma_chains; j++) acc[j] = j;
+    for(size_t i=0; i< n_iterations; i++){
+      for(int j=0; j< fma_chains; j++) acc[j] = acc[j]*0.999999 + 1e-6;
+    }
+    double sum = 0.0;
+    for(int j=0; j< fma_chains; j++) sum += acc[j];
+    return sum;
+  }
+
+  struct roofline{
+    double bandwidth = 0.0;/**< Memory bandwidth, bytes/s*/
+    double peak_flops = 0.0;/**< Peak floating-point rate, FLOP/s*/
+  };
+  /**< Machine limits for roofline comparison. @see measure_roofline*/
+
+  inline size_t probe_array_bytes(){
+    /** \internal Default size of each roofline triad array: four times the last-level cache, as STREAM asks, and at least 32 MiB*/
+    size_t bytes = (size_t)1 << 25;
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    long cache = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if(cache > 0) bytes = std::max(bytes, 4*(size_t)cache);
+#endif
+    return bytes;
+  }
+
+  inline roofline probe_roofline(int n_threads=0, size_t array_bytes=0){
+    /** \brief Measure memory bandwidth and peak FLOP rate
+    *
+    * Bandwidth from a STREAM triad over arrays too big for cache, counting 24 bytes per element as STREAM does, and peak from independent multiply-add chains. Both use n_threads threads, or all hardware threads for 0, and take the best of several repetitions, each timed from when the first thread starts to when the last finishes. Each of the three arrays is array_bytes, shared among the threads, or for 0 four times the L3 cache size from sysconf, and at least 32 MiB. Takes a second or so, more with big caches. Pass a size for machines where the cache size is unknown, or four times it is too much memory.
+    *
+    * The loops are compiled with the flags of the code including this header, so the figures are what code built the same way reaches. E.g. the peak includes fused multiply-add and wider vectors only if they are enabled, and in an unoptimised build both figures are far below the machine's. Call it from code built with optimisation for the real limits, or use set_roofline with known figures
+    */
+    if(n_threads <= 0) n_threads = std::max((int)std::thread::hardware_concurrency(), 1);
+    if(array_bytes == 0) array_bytes = probe_array_bytes();
+    const size_t n_total = array_bytes/sizeof(double), fma_iterations = 1 << 19;
+    const int n_reps = 10;
+    size_t n_each = std::max(n_total/n_threads, (size_t)1024);
+    typedef std::chrono::steady_clock::time_point time_point;
+    //Start and end of each rep on each thread, triad then multiply-add
+    std::vector<time_point> starts(2*n_reps*n_threads), ends(2*n_reps*n_threads);
+    std::atomic<int> arrived{0};
+    std::vector<std::thread> threads;
+    for(int t=0; t< n_threads; t++){
+      threads.push_back(std::thread([&, t](){
+        //Each thread touches its own arrays first, so they are in its nearest memory
+        std::vector<double> a(n_each, 0.0), b(n_each, 1.0), c(n_each, 2.0);
+        for(int rep=0; rep< 2*n_reps; rep++){
+          //Wait for all threads to finish the last rep
+          arrived++;
+          while(arrived < n_threads*(rep+1)) std::this_thread::yield();
+          size_t slot = rep*n_threads + t;
+          starts[slot] = std::chrono::steady_clock::now();
+          if(rep < n_reps){
+            triad_kernel(a.data(), b.data(), c.data(), 3.0, n_each);
+            clobber_memory();
+          }else{
+            do_not_optimize(fma_kernel(fma_iterations));
+          }
+          ends[slot] = std::chrono::steady_clock::now();
+        }
+      }));
+    }
+    for(size_t t=0; t< threads.size(); t++) threads[t].join();
+    roofline result;
+    for(int rep=0; rep< 2*n_reps; rep++){
+      time_point first = starts[rep*n_threads], last = ends[rep*n_threads];
+      for(int t=1; t< n_threads; t++){
+        first = std::min(first, starts[rep*n_threads + t]);
+        last = std::max(last, ends[rep*n_threads + t]);
+      }
+      double elapsed = std::chrono::duration<double>(last - first).count();
+      if(elapsed <= 0.0) continue;
+      if(rep < n_reps) result.bandwidth = std::max(result.bandwidth, 3.0*sizeof(double)*n_each*n_threads/elapsed);
+      else result.peak_flops = std::max(result.peak_flops, 2.0*fma_chains*fma_iterations*n_threads/elapsed);
+    }
+    return result;
+  }
+  inline roofline measure_roofline(int n_threads=0, size_t array_bytes=0){
+    /** Measure machine limits with probe_roofline, and compare tests declaring test_entity::bytes_moved or test_entity::flops with them. Call once at startup, before tests::run_tests. @see set_roofline*/
+    roofline result = probe_roofline(n_threads, array_bytes);
+    config::instance()->roofline_bandwidth = result.bandwidth;
+    config::instance()->roofline_flops = result.peak_flops;
+    return result;
+  }
+
+  inline std::string throughput_str(double bytes, double flops, double seconds){
+    /** \internal Achieved rates, and fractions of the roofline if known, for report_info*/
+    double bandwidth = config::instance()->roofline_bandwidth, peak = config::instance()->roofline_flops;
+    char buffer[100];
+    std::string text = "Throughput";
+    if(bytes > 0.0){
+      std::snprintf(buffer, 100, " %.3g GB/s", bytes/seconds*1e-9);
+      text += buffer;
+      if(bandwidth > 0.0){
+        std::snprintf(buffer, 100, " (%.1f%% of bandwidth)", 100.0*bytes/seconds/bandwidth);
+        text += buffer;
+      }
+    }
+    if(flops > 0.0){
+      std::snprintf(buffer, 100, "%s %.3g GFLOP/s", bytes > 0.0 ? "," : "", flops/seconds*1e-9);
+      text += buffer;
+      if(peak > 0.0){
+        std::snprintf(buffer, 100, " (%.1f%% of peak)", 100.0*flops/seconds/peak);
+        text += buffer;
+      }
+    }
+    if(bytes > 0.0 && flops > 0.0 && bandwidth > 0.0 && peak > 0.0){
+      //Roofline: attainable rate is limited by either peak or bandwidth times arithmetic intensity
+      double intensity = flops/bytes;
+      double attainable = std::min(peak, intensity*bandwidth);
+      std::snprintf(buffer, 100, ", %.1f%% of %s-bound roofline at %.3g FLOP/byte", 100.0*flops/seconds/attainable, attainable < peak ? "memory" : "compute", intensity);
+      text += buffer;
+    }
+    return text;
+  }
+
+  struct bench_stats{
+    size_t iterations = 0;/**< Kernel calls per sample*/
+    size_t n_samples = 0;/**< Number of timed samples*/
+    double median = 0.0;/**< Median time per call, s*/
+    double mad = 0.0;/**< Median absolute deviation of time per call, s*/
+    double min = 0.0;/**< Fastest time per call, s*/
+    double ci_low = 0.0;/**< Lower end of 95% confidence interval on the median, s*/
+    double ci_high = 0.0;/**< Upper end of 95% confidence interval on the median, s*/
+  };
+  /**< Summary statistics of a benchmark. Robust to the odd slow sample, e.g. from interrupts*/
+
+  inline bench_stats get_bench_stats(std::vector<double> samples){
+    /** \brief Summarise benchmark samples
+    *
+    * Median, MAD and minimum of the times per call in samples. Confidence interval on the median is from order statistics, so needs no assumption about the distribution.
+    */
+    bench_stats stats;
+    stats.n_samples = samples.size();
+    if(samples.empty()) return stats;
+    size_t n = samples.size();
+    std::sort(samples.begin(), samples.end());
+    auto median_of = [](const std::vector<double> & sorted){
+      size_t n = sorted.size();
+      return (n%2 == 1) ? sorted[n/2] : 0.5*(sorted[n/2-1] + sorted[n/2]);
+    };
+    stats.min = samples[0];
+    stats.median = median_of(samples);
+    std::vector<double> deviations(n);
+    for(size_t i=0; i< n; i++) deviations[i] = std::abs(samples[i] - stats.median);
+    std::sort(deviations.begin(), deviations.end());
+    stats.mad = median_of(deviations);
+    //Ranks bounding the median at 95% confidence, from normal approx to binomial
+    double half_width = 1.96*std::sqrt((double)n)/2.0;
+    long low = (long)std::floor(n/2.0 - half_width), high = (long)std::ceil(n/2.0 + half_width);
+    stats.ci_low = samples[std::max(low, 0L)];
+    stats.ci_high = samples[std::min(high, (long)n-1)];
+    return stats;
+  }
+
+  inline std::string mk_str(const bench_stats & stats){
+    /** Printable form of bench_stats*/
+    char buffer[200];
+    std::snprintf(buffer, 200, "median %.4g s, MAD %.3g s, min %.4g s, 95%% CI [%.4g, %.4g] s (%lu samples of %lu calls)", stats.median, stats.mad, stats.min, stats.ci_low, stats.ci_high, (unsigned long)stats.n_samples, (unsigned long)stats.iterations);
+    return buffer;
+  }
+
+  /**\brief Benchmark instance
+  *
+  *A test_entity which times a kernel instead of checking a result. Implement kernel() to do one unit of work, passing results to do_not_optimize() or calling clobber_memory() so it is not optimised out. The harness warms up, picks how many calls to make per sample so each lasts at least min_sample_time, then reports bench_stats through report_info. Tune the public parameters in the constructor. Register with REGISTER_BENCH. Benchmarks are serial_only so they are not disturbed by other tests.
+  */
+  class benchmark_entity : public test_entity{
+  private:
+    double time_calls(size_t n_calls){
+      auto start = std::chrono::steady_clock::now();
+      for(size_t i=0; i< n_calls; i++) kernel();
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    double agreed(double time){
+      /** Slowest rank's time, if the kernel is collective over comm, so all ranks make the same number of calls*/
+#ifdef USE_MPI
+      if(comm != MPI_COMM_NULL) MPI_Allreduce(MPI_IN_PLACE, &time, 1, MPI_DOUBLE, MPI_MAX, comm);
+#endif
+      return time;
+    }
+  public:
+    double warmup_time = 0.05;/**< Time to spend calling kernel before measuring, s*/
+    double min_sample_time = 1e-3;/**< Minimum duration of each sample, s*/
+    size_t n_samples = 30;/**< Number of samples to take*/
+    size_t max_iterations = 1000000000;/**< Limit on calls per sample*/
+    bench_stats stats;/**< Statistics from last run*/
+    std::vector<double> samples;/**< Time per call of each sample in last run, s*/
+    int threads = 1;/**< Number of threads kernel should use, e.g. for omp_set_num_threads. Set by scaling_study*/
+    int ranks = 0;/**< Number of MPI ranks in the run, if set by scaling_study, else 0*/
+#ifdef USE_MPI
+    MPI_Comm comm = MPI_COMM_NULL;/**< Communicator kernel should use, if it is collective. Set by scaling_study, or MPI_COMM_NULL on ranks left out of this run*/
+#endif
+
+    benchmark_entity(){serial_only = true;}
+    virtual ~benchmark_entity(){;}
+    virtual void kernel()=0;/**< One unit of the work to be timed*/
+    virtual TEST_ERR run();
+    virtual double performance_measure(const test_timing & /*timing*/) const {return stats.median;}/**< Median time per call, as total time doesn't depend on speed*/
+  };
+
+  struct alloc_counts{
+    std::atomic<size_t> entities{0};/**< Test objects built*/
+    std::atomic<size_t> arena_blocks{0};/**< Heap blocks taken by entity arenas*/
+    std::atomic<size_t> arena_bytes{0};/**< Total size of those blocks*/
+    std::atomic<size_t> reports{0};/**< Error reports formatted*/
+    std::atomic<size_t> format_growths{0};/**< Times a formatting buffer had to grow*/
+    static alloc_counts & instance(){static alloc_counts counts; return counts;}
+    void clear(){entities = 0; arena_blocks = 0; arena_bytes = 0; reports = 0; format_growths = 0;}
+  };
+  /**< \internal Allocation statistics, to check the arena and buffers are doing their job. Relaxed atomics, as they're only read at the end of a run*/
+
+  struct heap_counters{
+    size_t scope;/**< Run being measured on this thread, or 0*/
+    int paused;/**< Depth of heap_pause, during which allocations aren't counted*/
+    size_t allocations;/**< Allocations counted*/
+    size_t frees;/**< Frees of counted blocks*/
+    size_t bytes;/**< Total bytes allocated*/
+    long long live;/**< Bytes allocated and not yet freed*/
+    long long peak;/**< Greatest value of live*/
+  };
+  /**< \internal Heap use of the test running on this thread, counted by the TESTBED_MEMORY_HOOKS operator new and delete*/
+  inline heap_counters & thread_heap(){thread_local heap_counters counters; return counters;}
+  /**< \internal This thread's heap counters. Plain data, so thread_local costs no initialisation check inside operator new*/
+  inline bool & heap_hooks_installed(){static bool installed = false; return installed;}
+  /**< \internal Whether some translation unit defined TESTBED_MEMORY_HOOKS*/
+
+  struct perf_reading{
+    bool hardware = false;/**< Whether the hardware counts are valid*/
+    double cycles = 0.0;
+    double instructions = 0.0;
+    double cache_misses = 0.0;/**< Last-level cache misses*/
+    double branch_misses = 0.0;
+    double cpu_time = 0.0;/**< Thread CPU time, s*/
+    long page_faults = 0;
+    long context_switches = 0;
+  };
+  /**< \brief CPU performance counts. @see set_perf_counters
+  *
+  * Readings are cumulative, so subtract two to get the counts in between. Hardware counts are scaled up if the kernel had to share the counters with other users
+  */
+  inline perf_reading operator-(const perf_reading & end, const perf_reading & start){
+    perf_reading diff = end;
+    diff.hardware = end.hardware && start.hardware;
+    diff.cycles -= start.cycles;
+    diff.instructions -= start.instructions;
+    diff.cache_misses -= start.cache_misses;
+    diff.branch_misses -= start.branch_misses;
+    diff.cpu_time -= start.cpu_time;
+    diff.page_faults -= start.page_faults;
+    diff.context_switches -= start.context_switches;
+    return diff;
+  }
+
+  class perf_counters{
+  /** \internal \brief Hardware performance counters of the calling thread
+  *
+  * One per thread, opened on first use as a perf_event_open group and left counting, so a reading is one read call, and readings may nest. If the cycle counter can't be opened, only the software counts from getrusage are given. A forked worker reopens its own, as the inherited ones count its parent
+  */
+    static const int n_events = 4;
+    int fds[n_events];/**< Cycles, which leads the group, instructions, cache misses, branch misses. -1 if not open*/
+    int n_open = 0;/**< Events in group, in order*/
+    int order[n_events];/**< Which event each group value is*/
+    pid_t owner = 0;/**< Process the group was opened in, or 0 if not tried*/
+    double totals[n_events];/**< Scaled counts accumulated over all readings*/
+    uint64_t last_raw[n_events];
+    uint64_t last_enabled = 0, last_running = 0;
+
+    void close_all(){
+      for(int i=0; i< n_events; i++){
+        if(fds[i] >= 0) close(fds[i]);
+        fds[i] = -1;
+      }
+      n_open = 0;
+    }
+    void open_group(){
+      close_all();
+      owner = getpid();
+      last_enabled = last_running = 0;
+      for(int i=0; i< n_events; i++){totals[i] = 0.0; last_raw[i] = 0;}
+#ifdef __linux__
+      const uint64_t configs[n_events] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+      for(int i=0; i< n_events; i++){
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        int leader = (i == 0) ? -1 : fds[0];
+        fds[i] = (int) syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+        if(fds[i] < 0){
+          //No cycles means no group. Others may just be missing on this CPU
+          if(i == 0) return;
+          continue;
+        }
+        order[n_open++] = i;
+      }
+#endif
+    }
+  public:
+    static perf_counters & local(){thread_local perf_counters counters; return counters;}
+    perf_counters(){for(int i=0; i< n_events; i++) fds[i] = -1;}
+    perf_counters(const perf_counters &) = delete;
+    perf_counters & operator=(const perf_counters &) = delete;
+    ~perf_counters(){close_all();}
+    perf_reading read_now(){
+      /** Cumulative counts so far on this thread*/
+      perf_reading reading;
+      if(owner != getpid()) open_group();
+      if(n_open > 0){
+        uint64_t buffer[3 + n_events];
+        ssize_t got = ::read(fds[0], buffer, sizeof(buffer));
+        if(got >= (ssize_t)((3 + n_open)*sizeof(uint64_t)) && buffer[0] == (uint64_t)n_open){
+          //Scale each interval separately, so a reading isn't skewed by sharing long ago
+          uint64_t enabled = buffer[1] - last_enabled, running = buffer[2] - last_running;
+          double scale = (running > 0) ? (double) enabled / running : 0.0;
+          for(int i=0; i< n_open; i++){
+            totals[order[i]] += scale*(buffer[3+i] - last_raw[order[i]]);
+            last_raw[order[i]] = buffer[3+i];
+          }
+          last_enabled = buffer[1];
+          last_running = buffer[2];
+          reading.hardware = (buffer[2] > 0);
+        }
+        reading.cycles = totals[0];
+        reading.instructions = totals[1];
+        reading.cache_misses = totals[2];
+        reading.branch_misses = totals[3];
+      }
+      timespec now;
+      if(clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0) reading.cpu_time = now.tv_sec + 1e-9*now.tv_nsec;
+      rusage usage;
+#ifdef RUSAGE_THREAD
+      if(getrusage(RUSAGE_THREAD, &usage) == 0){
+#else
+      if(getrusage(RUSAGE_SELF, &usage) == 0){
+#endif
+        reading.page_faults = usage.ru_minflt + usage.ru_majflt;
+        reading.context_switches = usage.ru_nvcsw + usage.ru_nivcsw;
+      }
+      return reading;
+    }
+  };
+
+  inline std::string mk_str(const perf_reading & counts, double per=1.0){
+    /** Summary of counts, as IPC and misses per thousand instructions, or software counts only if no hardware ones. Counts are divided by per, e.g. the number of calls*/
+    std::string text;
+    if(counts.hardware && counts.cycles > 0.0 && counts.instructions > 0.0){
+      double kilo_instr = counts.instructions/1000.0;
+      text = "IPC "+mk_str(counts.instructions/counts.cycles)+", LLC MPKI "+mk_str(counts.cache_misses/kilo_instr)+", branch MPKI "+mk_str(counts.branch_misses/kilo_instr)+", "+mk_str(counts.instructions/per)+" instructions, "+mk_str(counts.cycles/per)+" cycles, ";
+    }else{
+      text = "no hardware counters, ";
+    }
+    if(per == 1.0) text += "CPU "+mk_str(counts.cpu_time)+" s, "+mk_str(counts.page_faults)+" page faults, "+mk_str(counts.context_switches)+" context switches";
+    else text += "CPU "+mk_str(counts.cpu_time/per)+" s, "+mk_str(counts.page_faults/per)+" page faults, "+mk_str(counts.context_switches/per)+" context switches";
+    return text;
+  }
+
+  struct fp_flags{
+    int raised = 0;/**< fenv exception flags raised*/
+    bool denormal = false;/**< Whether an operand was denormal*/
+  };
+  /**< \internal Floating-point exceptions seen. @see set_fp_checks*/
+
+  inline void clear_fp_flags(){
+    /** \internal Clear this thread's floating-point exception flags*/
+    feclearexcept(FE_ALL_EXCEPT);
+#if defined(__SSE2__)
+    //Denormal operand flag is x86-only, so fenv doesn't cover it
+    _mm_setcsr(_mm_getcsr() & ~0x3fu);
+#endif
+  }
+  inline fp_flags get_fp_flags(){
+    /** \internal Read this thread's floating-point exception flags*/
+    fp_flags flags;
+    flags.raised = fetestexcept(FE_ALL_EXCEPT);
+#if defined(__SSE2__)
+    flags.denormal = (_mm_getcsr() & 0x02u) != 0;
+#endif
+    return flags;
+  }
+  inline void trap_fp(bool on){
+    /** \internal Turn trapping of invalid operations and division by zero on or off, where supported*/
+#if defined(__GLIBC__)
+    if(on) feenableexcept(FE_INVALID | FE_DIVBYZERO);
+    else fedisableexcept(FE_INVALID | FE_DIVBYZERO);
+#else
+    (void) on;
+#endif
+  }
+
+  class heap_pause{
+  /** \internal Stop counting this thread's allocations while in scope, for the testbed's own work during a test, such as logging, so it isn't blamed on the test*/
+  public:
+    heap_pause(){thread_heap().paused++;}
+    ~heap_pause(){thread_heap().paused--;}
+    heap_pause(const heap_pause &) = delete;
+    heap_pause & operator=(const heap_pause &) = delete;
+  };
+
+  struct heap_block{
+    size_t size;/**< Bytes requested*/
+    size_t scope;/**< Run it was counted against, or 0*/
+  };
+  /**< \internal Header in front of each block from the hooked operator new. Two words, so the block keeps malloc's alignment*/
+
+  inline void * heap_allocate(size_t size){
+    /** \internal Allocate for the hooked operator new, counting against this thread's test if any*/
+    heap_block * block = static_cast<heap_block *>(std::malloc(sizeof(heap_block) + size));
+    if(!block) return nullptr;
+    heap_counters & counters = thread_heap();
+    block->size = size;
+    block->scope = (counters.paused == 0) ? counters.scope : 0;
+    if(block->scope != 0){
+      counters.allocations++;
+      counters.bytes += size;
+      counters.live += size;
+      if(counters.live > counters.peak) counters.peak = counters.live;
+    }
+    return block + 1;
+  }
+  inline void heap_free(void * ptr){
+    /** \internal Free for the hooked operator delete. Only blocks counted against the run in progress on this thread are subtracted*/
+    if(!ptr) return;
+    heap_block * block = static_cast<heap_block *>(ptr) - 1;
+    heap_counters & counters = thread_heap();
+    if(block->scope != 0 && block->scope == counters.scope){
+      counters.frees++;
+      counters.live -= block->size;
+    }
+    std::free(block);
+  }
+
+  class entity_arena{
+  /** \internal \brief Monotonic arena for test objects
+  *
+  * One per thread. Objects are bump-allocated from the current block, and once none is alive the arena rewinds to the start, keeping its blocks. This relies on each thread having only one test object alive at a time: tests::add builds a test and frees it at once, and run_one builds it again on the thread which runs it and frees it straight after. So a thread soon needs no more heap for test objects, however many tests it adds or runs. Objects must be freed on the thread which built them
+  */
+    struct block{
+      char * data;
+      size_t size;
+    };
+    std::vector<block> blocks;
+    size_t current = 0;/**< Block being allocated from*/
+    size_t offset = 0;/**< Next free byte in it*/
+    size_t live = 0;/**< Objects not yet released*/
+  public:
+    static entity_arena & local(){thread_local entity_arena arena; return arena;}
+    entity_arena(){;}
+    entity_arena(const entity_arena &) = delete;
+    entity_arena & operator=(const entity_arena &) = delete;
+    ~entity_arena(){for(size_t i=0; i< blocks.size(); i++) ::operator delete(blocks[i].data);}
+    void * allocate(size_t size, size_t align){
+      /** Space for an object of given size and alignment*/
+      for(;; current++, offset = 0){
+        if(current == blocks.size()){
+          block fresh;
+          fresh.size = std::max((size_t)4096, 2*(size + align));
+          fresh.data = static_cast<char *>(::operator new(fresh.size));
+          blocks.push_back(fresh);
+          alloc_counts::instance().arena_blocks.fetch_add(1, std::memory_order_relaxed);
+          alloc_counts::instance().arena_bytes.fetch_add(fresh.size, std::memory_order_relaxed);
+        }
+        uintptr_t base = reinterpret_cast<uintptr_t>(blocks[current].data);
+        size_t start = (base + offset + align - 1)/align*align - base;
+        if(start + size <= blocks[current].size){
+          offset = start + size;
+          live++;
+          return blocks[current].data + start;
+        }
+      }
+    }
+    void release(){
+      /** An object is done with. Rewind once all are*/
+      if(live > 0 && --live == 0){
+        current = 0;
+        offset = 0;
+      }
+    }
+  };
+
+  struct entity_deleter{
+    entity_arena * arena;
+    void operator()(test_entity * test) const{
+      test->~test_entity();
+      arena->release();
+    }
+  };
+  /**< \internal Destroys a test object built in an entity_arena. Must run on the thread which built it*/
+  typedef std::unique_ptr<test_entity, entity_deleter> entity_ptr;/**< Owning pointer to a test object*/
+
+  struct entity_maker{
+    size_t size;
+    size_t align;
+    std::function<test_entity*(void *)> construct;/**< Constructs the test at the given address*/
+  };
+  /**< \internal How to build a registered test*/
+
+  class test_factory{
+  /** \internal \brief Factory producing test instances
+  *
+  *Adapted from http://www.codeproject.com/Articles/567242/AplusC-b-bplusObjectplusFactory
+  */
+  
+  friend class tests;
+  friend class fixture_store;
+  private:
+    std::map<std::string, entity_maker> factoryFunctionRegistry;
+    std::map<std::string, bool> benchmarkRegistry;/**< Whether each registered name is a benchmark*/
+    std::map<std::string, std::vector<std::string> > tagRegistry;/**< Tags of each registered name*/
+    std::map<std::string, std::function<fixture*(void)> > fixtureRegistry;/**< Constructors of shared fixtures*/
+    std::map<std::string, std::set<std::string> > tagIndex;/**< Registered names with each tag*/
+    std::map<std::string, bool> selected;/**< Whether each registered name matches the selection. Built when first needed*/
+    bool selection_current = false;/**< Whether selected is up to date*/
+    void update_selection();
+  public:
+    /** \internal Register a test_entity constructor*/
+    void registerFactoryFunction(std::string name, entity_maker classFactoryFunction){ factoryFunctionRegistry[name] = classFactoryFunction; selection_current = false;}
+    /** \internal Register a fixture constructor*/
+    void registerFixture(std::string name, std::function<fixture*(void)> fixtureFactoryFunction){ fixtureRegistry[name] = fixtureFactoryFunction;}
+    /** \internal Mark a registered name as a benchmark*/
+    void registerBenchmark(std::string name){ benchmarkRegistry[name] = true;}
+    /** \internal Add tags to a registered name, from a comma-separated list*/
+    void registerTags(std::string name, const std::string & tags){
+      size_t start = 0;
+      while(start <= tags.size()){
+        size_t end = std::min(tags.find(',', start), tags.size());
+        std::string tag = tags.substr(start, end - start);
+        tag.erase(0, tag.find_first_not_of(' '));
+        tag.erase(tag.find_last_not_of(' ') + 1);
+        if(!tag.empty() && tagIndex[tag].insert(name).second) tagRegistry[name].push_back(tag);
+        start = end + 1;
+      }
+      selection_current = false;
+    }
+    /** \internal Mark cached selection as out of date*/
+    void selection_changed(){selection_current = false;}
+    bool is_selected(const std::string & name);
+    static test_factory * instance();
+    entity_ptr create(const std::string & name);
+
+  };
+  inline test_factory * test_factory::instance(){
+    /** \internal Return the factory singleton instance*/
+    static test_factory factory;
+    return &factory;
+  }
+
+  inline entity_ptr test_factory::create(const std::string & name){
+    /** \internal \brief Create test_entity
+    *
+    * Create an instance of a test_entity previously registered, owned by the caller. It is built in this thread's entity_arena, so must be destroyed in this thread. Null if there is no such test
+    */
+      entity_arena & arena = entity_arena::local();
+      // find name in the registry and call factory method.
+      auto it = this->factoryFunctionRegistry.find(name);
+      if(it == this->factoryFunctionRegistry.end()) return entity_ptr(nullptr, entity_deleter{&arena});
+      void * place = arena.allocate(it->second.size, it->second.align);
+      test_entity * instance;
+      try{
+        instance = it->second.construct(place);
+      }catch(...){
+        arena.release();
+        throw;
+      }
+      alloc_counts::instance().entities.fetch_add(1, std::memory_order_relaxed);
+      return entity_ptr(instance, entity_deleter{&arena});
+  }
+  
+  inline bool match_pattern(const std::string & pattern, const std::regex * compiled, const std::string & name){
+    /** \internal Match name against a glob, or a regular expression if one is compiled*/
+    if(compiled) return std::regex_search(name, *compiled);
+    return fnmatch(pattern.c_str(), name.c_str(), 0) == 0;
+  }
+
+  inline void test_factory::update_selection(){
+    /** \internal \brief Work out which registered tests are selected
+    *
+    * Done once per change of selection or registry, so each add or lookup is then a single map lookup. Regular expressions are compiled only once, and tags come from the index. An invalid regular expression matches nothing
+    */
+    const test_selection & selection = config::instance()->selection;
+    auto compile = [](const std::vector<std::string> & patterns){
+      std::vector<std::unique_ptr<std::regex> > compiled(patterns.size());
+      for(size_t i=0; i< patterns.size(); i++){
+        if(patterns[i].compare(0, 3, "re:") != 0) continue;
+        try{
+          compiled[i].reset(new std::regex(patterns[i].substr(3)));
+        }catch(const std::regex_error &){
+          my_print("Invalid regular expression "+patterns[i].substr(3));
+          compiled[i].reset(new std::regex("$^"));
+        }
+      }
+      return compiled;
+    };
+    std::vector<std::unique_ptr<std::regex> > include = compile(selection.include), exclude = compile(selection.exclude);
+    auto tagged = [this](const std::vector<std::string> & tags){
+      std::set<std::string> names;
+      for(size_t i=0; i< tags.size(); i++){
+        auto it = tagIndex.find(tags[i]);
+        if(it != tagIndex.end()) names.insert(it->second.begin(), it->second.end());
+      }
+      return names;
+    };
+    std::set<std::string> with_tags = tagged(selection.tags), without_tags = tagged(selection.exclude_tags);
+
+    selected.clear();
+    for(auto it = factoryFunctionRegistry.begin(); it != factoryFunctionRegistry.end(); it++){
+      const std::string & name = it->first;
+      bool on = selection.include.empty();
+      for(size_t i=0; i< selection.include.size() && !on; i++) on = match_pattern(selection.include[i], include[i].get(), name);
+      if(on && !selection.tags.empty()) on = with_tags.count(name) > 0;
+      if(on) on = without_tags.count(name) == 0;
+      for(size_t i=0; i< selection.exclude.size() && on; i++) on = !match_pattern(selection.exclude[i], exclude[i].get(), name);
+      selected[name] = on;
+    }
+    selection_current = true;
+  }
+  inline bool test_factory::is_selected(const std::string & name){
+    /** \internal Whether registered name matches the selection. Unknown names do, so adding them gives the usual error*/
+    if(!selection_current) update_selection();
+    auto it = selected.find(name);
+    return it == selected.end() || it->second;
+  }
+
+  inline void set_selection(const test_selection & selection){
+    /** \brief Choose which tests run
+    *
+    * Tests added with tests::add or tests::add_all are only kept if their registered name matches one of selection.include (if any), has one of selection.tags (if any), and matches no exclude pattern or exclude tag. Patterns are shell-style globs such as "setup*", or regular expressions if they start re:, which may match any part of the name. The tests kept are then dealt round-robin into n_shards shards, in the order added, and only shard number shard (from 1) is kept, so separate jobs can split a suite. See parse_args to set this from the command line
+    */
+    config::instance()->selection = selection;
+    config::instance()->selection.n_shards = std::max(selection.n_shards, 1);
+    config::instance()->selection.shard = std::min(std::max(selection.shard, 1), config::instance()->selection.n_shards);
+    test_factory::instance()->selection_changed();
+  }
+
+  inline bool parse_args(int argc, char ** argv){
+    /** \brief Set test selection from the command line
+    *
+    * Understands -f/--filter PATTERN (or a bare PATTERN), -x/--exclude PATTERN, -t/--tag TAG, -T/--exclude-tag TAG, --shard I/N and --list. Options taking values may also be written --option=value. Each may be given more than once. See set_selection for their meaning. Returns false, having printed usage, on --help or an error
+    */
+    test_selection selection;
+    std::string usage = "Usage: "+std::string(argc > 0 ? argv[0] : "tests")+" [-f|--filter PATTERN]... [-x|--exclude PATTERN]... [-t|--tag TAG]... [-T|--exclude-tag TAG]... [--shard I/N] [--list]\n  Patterns are globs, or regular expressions if prefixed re:";
+    for(int i=1; i< argc; i++){
+      std::string arg = argv[i], value;
+      size_t equals = arg.find('=');
+      bool has_value = arg.compare(0, 2, "--") == 0 && equals != std::string::npos;
+      if(has_value){
+        value = arg.substr(equals+1);
+        arg = arg.substr(0, equals);
+      }
+      if(arg == "--list"){
+        selection.list_only = true;
+        continue;
+      }
+      if(arg == "-h" || arg == "--help"){
+        my_print(usage);
+        return false;
+      }
+      if(arg.empty() || arg[0] != '-'){
+        selection.include.push_back(arg);
+        continue;
+      }
+      const char * with_values[] = {"-f", "--filter", "-x", "--exclude", "-t", "--tag", "-T", "--exclude-tag", "--shard"};
+      if(std::find(with_values, with_values+9, arg) == with_values+9){
+        my_print("Unknown option "+arg+"\n"+usage);
+        return false;
+      }
+      if(!has_value){
+        if(i+1 >= argc){
+          my_print("Missing value for "+arg+"\n"+usage);
+          return false;
+        }
+        value = argv[++i];
+      }
+      if(arg == "-f" || arg == "--filter") selection.include.push_back(value);
+      else if(arg == "-x" || arg == "--exclude") selection.exclude.push_back(value);
+      else if(arg == "-t" || arg == "--tag") selection.tags.push_back(value);
+      else if(arg == "-T" || arg == "--exclude-tag") selection.exclude_tags.push_back(value);
+      else if(arg == "--shard"){
+        char slash;
+        std::istringstream parts(value);
+        if(!(parts >> selection.shard >> slash >> selection.n_shards) || slash != '/' || selection.n_shards < 1 || selection.shard < 1 || selection.shard > selection.n_shards){
+          my_print("Bad shard "+value+", expected I/N with 1 <= I <= N");
+          return false;
+        }
+      }
+    }
+    set_selection(selection);
+    return true;
+  }
+
+  template<class T>
   class Registrar {
   /** \internal Registrar calls register method of test_factory to do the actual registering. @see REGISTER
   */
   public:
-      Registrar(std::string name)
-      {
-          // register the class factory function
-          test_factory::instance()->registerFactoryFunction(name,
-                  [](void) -> test_entity * { return new T();});
-      }
+      Registrar(std::string name, bool is_bench=false, const std::string & tags="")
+      {
+          static_assert(std::is_base_of<test_entity, T>::value, "Registered class must derive from test_entity");
+          // register the class factory function
+          entity_maker maker = {sizeof(T), alignof(T), [](void * place) -> test_entity * { return new(place) T();}};
+          test_factory::instance()->registerFactoryFunction(name, maker);
+          if(is_bench){
+            test_factory::instance()->registerBenchmark(name);
+            test_factory::instance()->registerTags(name, "benchmark");
+          }
+          test_factory::instance()->registerTags(name, tags);
+      }
+  };
+
+  template<class T>
+  class BenchRegistrar : public Registrar<T> {
+  /** \internal As Registrar, for benchmarks. @see REGISTER_BENCH
+  */
+  public:
+      BenchRegistrar(std::string name) : Registrar<T>(name, true)
+      {
+          static_assert(std::is_base_of<benchmark_entity, T>::value, "Benchmarks registered with REGISTER_BENCH must derive from benchmark_entity");
+      }
+  };
+
+  template<class T>
+  class FixtureRegistrar {
+  /** \internal Registers a fixture constructor with test_factory. @see REGISTER_FIXTURE
+  */
+  public:
+      FixtureRegistrar(std::string name){
+          static_assert(std::is_base_of<fixture, T>::value, "Registered fixture must derive from fixture");
+          test_factory::instance()->registerFixture(name, [](void) -> fixture * { return new T();});
+      }
+  };
+
+  struct scaling_point{
+    double size = 0.0;/**< Problem size, as given to scaling_study::add_size*/
+    int threads = 1;
+    int ranks = 1;
+    double time = 0.0;/**< Median time per call, s, or 0 if the run failed*/
+    double speedup = 0.0;/**< Over the run with fewest workers at this size, assuming that scaled perfectly*/
+    double efficiency = 0.0;/**< Speedup per worker*/
+    double karp_flatt = -1.0;/**< Serial fraction from the Karp-Flatt metric, or -1 for a single worker*/
+    double weak_efficiency = -1.0;/**< Time of the run with fewest workers at the same size per worker, over this time, or -1 if there is none*/
+    int workers() const {return threads*ranks;}/**< Threads times ranks*/
+  };
+  /**< One run of a scaling study*/
+
+  inline void get_scaling_metrics(std::vector<scaling_point> & points){
+    /** \brief Fill in speedup, efficiency, Karp-Flatt metric and weak-scaling efficiency
+    *
+    * Strong scaling compares runs of the same size against the one with fewest workers. Weak scaling compares runs against one with the fewest workers of any, and the same size per worker. Runs with zero time are left out
+    */
+    int min_workers = std::numeric_limits<int>::max();
+    for(size_t i=0; i< points.size(); i++) if(points[i].time > 0.0) min_workers = std::min(min_workers, points[i].workers());
+    for(size_t i=0; i< points.size(); i++){
+      scaling_point & point = points[i];
+      if(point.time <= 0.0) continue;
+      const scaling_point * base = nullptr, * weak_base = nullptr;
+      for(size_t j=0; j< points.size(); j++){
+        const scaling_point & other = points[j];
+        if(other.time <= 0.0) continue;
+        if(other.size == point.size && (!base || other.workers() < base->workers())) base = &other;
+        bool same_share = point.size > 0.0 && std::abs(other.size*point.workers() - point.size*other.workers()) <= 1e-9*point.size*other.workers();
+        if(same_share && other.workers() == min_workers) weak_base = &other;
+      }
+      double p = point.workers();
+      point.speedup = base->workers()*base->time/point.time;
+      point.efficiency = point.speedup/p;
+      point.karp_flatt = (p > 1) ? (1.0/point.speedup - 1.0/p)/(1.0 - 1.0/p) : -1.0;
+      if(weak_base) point.weak_efficiency = weak_base->time/point.time;
+    }
+  }
+
+  class scaling_study{
+  /** \brief Scaling study of a benchmark
+  *
+  * Runs a registered benchmark for every combination of problem size, thread count and MPI rank count, and tabulates speedup, parallel efficiency and Karp-Flatt metric, as CSV and in the log. Sizes are set up by a function, usually made with ADDABLE_FN, and the benchmark reads benchmark_entity::threads and benchmark_entity::comm to know what to use. Add to a tests object with tests::add_scaling. E.g.
+
+    testbed::scaling_study study("stencil", "stencil_scaling.csv");
+
+    study.threads = {1, 2, 4, 8};
+
+    study.add_size(1e6, (ADDABLE_FN_TYPE(stencil)) ADDABLE_FN(stencil::setup, 1000000));
+
+  * For weak scaling, add sizes in proportion to the worker counts
+  */
+  public:
+    std::string benchmark;/**< Name the benchmark is registered under*/
+    std::string csv_file;/**< File for results, written by rank 0 after tests::run_tests*/
+    std::vector<int> threads;/**< Thread counts to run with. Default just 1*/
+    std::vector<int> ranks;/**< MPI rank counts to run with, taking the lowest ranks of set_mpi_comm's communicator. Default all*/
+    std::vector<std::pair<double, std::function<void(test_entity *)> > > sizes;/**< Problem sizes and their setup functions*/
+
+    scaling_study(const std::string & benchmark, const std::string & csv_file) : benchmark(benchmark), csv_file(csv_file), threads(1, 1){;}
+    template <typename T> void add_size(double size, std::function<void(T)> setup){
+      /** Add a problem size, with function to set the benchmark up for it*/
+      sizes.push_back(std::make_pair(size, [setup](test_entity * test){setup(dynamic_cast<T>(test));}));
+    }
+    void add_size(double size){sizes.push_back(std::make_pair(size, std::function<void(test_entity *)>()));}
+    /**< Add a problem size needing no setup, just to label results*/
+  };
+
+  class fixture_store{
+  /** \internal \brief Fixtures in use during a run
+  *
+  * Each fixture is built by the first test to ask for it, while any others asking wait. Tests declare which fixtures they use, so each has a count of tests yet to finish, and is destroyed when that reaches zero. Once any test uses a fixture without declaring it, we can't know when it is done, so the fixture is kept to the end of the run
+  */
+    struct entry{
+      std::unique_ptr<fixture> object;
+      int users = 0;/**< Declared users yet to finish*/
+      bool pinned = false;/**< Used by a test which didn't declare it, so kept to the end of the run*/
+      bool building = false;
+      bool failed = false;/**< Unknown fixture, or constructor threw*/
+      std::string error;/**< What the constructor threw, if it did*/
+    };
+    std::mutex lock;
+    std::condition_variable built;
+    std::map<std::string, entry> entries;
+  public:
+    void expect(const std::string & name){
+      /** One more declared user*/
+      std::lock_guard<std::mutex> guard(lock);
+      entries[name].users++;
+    }
+    fixture * acquire(const std::string & name, bool declared, std::string & error){
+      /** Get fixture, building it if needed. Null if it can't be built, with error set if its constructor threw. declared is whether the caller is one of its expected users*/
+      std::unique_lock<std::mutex> guard(lock);
+      entry & item = entries[name];
+      if(!declared) item.pinned = true;
+      while(item.building) built.wait(guard);
+      if(item.object || item.failed){
+        error = item.error;
+        return item.object.get();
+      }
+      auto factory = test_factory::instance()->fixtureRegistry.find(name);
+      if(factory == test_factory::instance()->fixtureRegistry.end()){
+        item.failed = true;
+        return nullptr;
+      }
+      //Build without the lock, so other fixtures can be built at the same time
+      item.building = true;
+      guard.unlock();
+      fixture * object = nullptr;
+      //Exceptions stop here, as one escaping a pool thread would end the run, and waiters must be woken either way
+      try{
+        //Fixture outlives the test that happens to build it, so isn't its leak
+        heap_pause pause;
+        object = factory->second();
+      }catch(const std::exception & e){
+        error = *e.what() ? e.what() : "exception";
+      }catch(...){
+        error = "unknown exception";
+      }
+      guard.lock();
+      if(!object){
+        item.failed = true;
+        item.error = error;
+      }
+      item.object.reset(object);
+      item.building = false;
+      built.notify_all();
+      return object;
+    }
+    void release(const std::string & name){
+      /** A declared user is finished. Destroys the fixture if it was the last*/
+      std::unique_ptr<fixture> last;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(name);
+        if(it == entries.end() || --it->second.users > 0 || it->second.building || it->second.pinned) return;
+        last = std::move(it->second.object);
+        entries.erase(it);
+      }
+      //Destroy outside the lock, as it may take a while
+    }
+    void clear(){
+      std::lock_guard<std::mutex> guard(lock);
+      entries.clear();
+    }
+  };
+
+  class work_pool{
+  /** \internal \brief Minimal work-stealing pool
+  *
+  * Each worker owns a queue of task indices. It takes from the front of its own queue and, once that is empty, steals from the back of the others'. Tasks are whole tests, so a lock per queue is ample. No tasks are added after starting, so when every queue is empty we are done.
+  */
+    struct task_queue{
+      std::mutex lock;
+      std::deque<size_t> tasks;
+    };
+    std::vector<std::unique_ptr<task_queue> > queues;
+
+    bool next_task(int worker, size_t & task){
+      for(size_t i=0; i< queues.size(); i++){
+        //Own queue first, then the rest in turn
+        size_t victim = (worker + i)%queues.size();
+        std::lock_guard<std::mutex> guard(queues[victim]->lock);
+        if(queues[victim]->tasks.empty()) continue;
+        if(i == 0){
+          task = queues[victim]->tasks.front();
+          queues[victim]->tasks.pop_front();
+        }else{
+          task = queues[victim]->tasks.back();
+          queues[victim]->tasks.pop_back();
+        }
+        return true;
+      }
+      return false;
+    }
+
+  public:
+    void run(const std::vector<size_t> & tasks, int n_threads, std::function<void(size_t, int)> do_task){
+    /** \internal Run do_task(task, worker) for every task, using n_threads including the caller. Tasks are dealt out round-robin so early tasks tend to finish first*/
+      n_threads = std::max(1, std::min(n_threads, (int)tasks.size()));
+      queues.clear();
+      for(int i=0; i< n_threads; i++) queues.push_back(std::unique_ptr<task_queue>(new task_queue()));
+      for(size_t i=0; i< tasks.size(); i++) queues[i%n_threads]->tasks.push_back(tasks[i]);
+
+      auto worker_loop = [this, &do_task](int worker){
+        size_t task;
+        while(next_task(worker, task)) do_task(task, worker);
+      };
+      std::vector<std::thread> workers;
+      for(int i=1; i< n_threads; i++) workers.push_back(std::thread(worker_loop, i));
+      worker_loop(0);
+      for(size_t i=0; i< workers.size(); i++) workers[i].join();
+    }
+  };
+
+  class watchdog{
+  /** \internal \brief Enforce test time limits
+  *
+  * A thread which sleeps until the nearest deadline of the tests being watched. If a test overruns, calls on_timeout with the test id, time limit and any worker process id. Tests are watched and unwatched by the runner, so this is off the hot path. on_timeout is called holding the lock remove takes, so once remove returns a test's timeout has either been handled in full or will never happen. It must not add or remove watches
+  */
+    struct watch{
+      std::chrono::steady_clock::time_point deadline;
+      double limit;
+      pid_t pid;
+    };
+    std::map<size_t, watch> watches;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::thread thread;
+    std::function<void(size_t, double, pid_t)> on_timeout;
+
+    void loop(){
+      std::unique_lock<std::mutex> guard(lock);
+      while(!stopping){
+        auto now = std::chrono::steady_clock::now();
+        auto next = now + std::chrono::hours(1);
+        for(auto it = watches.begin(); it != watches.end();){
+          if(it->second.deadline <= now){
+            //Still watched, as we hold the lock, so the test can't be finishing under us
+            on_timeout(it->first, it->second.limit, it->second.pid);
+            it = watches.erase(it);
+            continue;
+          }
+          next = std::min(next, it->second.deadline);
+          it++;
+        }
+        wake.wait_until(guard, next);
+      }
+    }
+  public:
+    ~watchdog(){stop();}
+    void start(std::function<void(size_t, double, pid_t)> callback){
+      if(thread.joinable()) return;
+      on_timeout = callback;
+      stopping = false;
+      thread = std::thread(&watchdog::loop, this);
+    }
+    void stop(){
+      if(!thread.joinable()) return;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        watches.clear();
+      }
+      wake.notify_one();
+      thread.join();
+    }
+    bool running(){return thread.joinable();}
+    void hold(){lock.lock();}/**< Keep the watchdog out of on_timeout until release, e.g. across a fork*/
+    void release(){lock.unlock();}
+    void add(size_t test_id, double limit, pid_t pid=0){
+    /** Start watching a test, with time limit in s*/
+      if(limit <= 0.0 || !running()) return;
+      watch entry;
+      entry.deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(limit));
+      entry.limit = limit;
+      entry.pid = pid;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        watches[test_id] = entry;
+      }
+      wake.notify_one();
+    }
+    void remove(size_t test_id){
+      /** Stop watching a test. Waits for any timeout of it already being handled*/
+      if(!running()) return;
+      std::lock_guard<std::mutex> guard(lock);
+      watches.erase(test_id);
+    }
+  };
+
+  struct log_line{
+    std::string text;
+    char colour;
+    bool flush = false;/**< Whether to make sure this line is written out at once, e.g. a failure*/
+  };
+  /**< \internal A line of test output, held back when tests run in parallel*/
+
+  class test_timer{
+  /** \internal \brief Time a test
+  *
+  * Reads the steady clock and rusage once at start and once at stop only. CPU times are for the calling thread where the OS supports it, so are correct for tests run in parallel. Peak RSS is process-wide.
+  */
+    std::chrono::steady_clock::time_point wall_start;
+    struct rusage usage_start;
+    long rss_start;
+
+    static void thread_usage(struct rusage & usage){
+#ifdef RUSAGE_THREAD
+      getrusage(RUSAGE_THREAD, &usage);
+#else
+      getrusage(RUSAGE_SELF, &usage);
+#endif
+    }
+    static long peak_rss(){
+      struct rusage usage;
+      getrusage(RUSAGE_SELF, &usage);
+      return usage.ru_maxrss;
+    }
+    static double seconds(const struct timeval & tv){return tv.tv_sec + 1e-6*tv.tv_usec;}
+  public:
+    void start(){
+      rss_start = peak_rss();
+      thread_usage(usage_start);
+      wall_start = std::chrono::steady_clock::now();
+    }
+    test_timing stop(){
+      test_timing timing;
+      timing.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wall_start).count();
+      struct rusage usage;
+      thread_usage(usage);
+      timing.user = seconds(usage.ru_utime) - seconds(usage_start.ru_utime);
+      timing.sys = seconds(usage.ru_stime) - seconds(usage_start.ru_stime);
+      timing.rss_kb = peak_rss() - rss_start;
+      return timing;
+    }
+  };
+
+  inline std::string mk_str(const test_timing & timing){
+    /** Printable form of a test_timing, times in ms*/
+    char buffer[100];
+    std::snprintf(buffer, 100, "wall %.3f ms, user %.3f ms, sys %.3f ms, peak RSS +%ld kB", 1e3*timing.wall, 1e3*timing.user, 1e3*timing.sys, timing.rss_kb);
+    return buffer;
+  }
+
+  template <typename T> void pack_value(std::string & buffer, const T & value){
+    /** \internal Append raw bytes of value to buffer*/
+    buffer.append(reinterpret_cast<const char *>(&value), sizeof(T));
+  }
+  inline void pack_value(std::string & buffer, const std::string & value){
+    pack_value(buffer, value.size());
+    buffer += value;
+  }
+  template <typename T> bool unpack_value(const char *& pos, const char * end, T & value){
+    /** \internal Read value from pos, advancing it. False if buffer is too short*/
+    if(end - pos < (long)sizeof(T)) return false;
+    std::copy(pos, pos+sizeof(T), reinterpret_cast<char *>(&value));
+    pos += sizeof(T);
+    return true;
+  }
+  inline bool unpack_value(const char *& pos, const char * end, std::string & value){
+    size_t len;
+    if(!unpack_value(pos, end, len) || end - pos < (long)len) return false;
+    value.assign(pos, len);
+    pos += len;
+    return true;
+  }
+
+  struct test_result{
+    TEST_ERR err = TEST_PASSED;
+    bool done = false;
+    bool remote = false;/**< Whether the test was run by another rank or process*/
+    int rank = 0;/**< MPI rank which ran the test*/
+    std::vector<log_line> output;
+    test_timing timing;
+    double measure = 0.0;/**< test_entity::performance_measure, s*/
+    bool skipped = false;/**< Whether the test was not run, with set_fail_fast*/
+
+    void pack(std::string & buffer) const{
+    /** Append to buffer in a form unpack can read, e.g. in another process*/
+      pack_value(buffer, err);
+      pack_value(buffer, rank);
+      pack_value(buffer, timing);
+      pack_value(buffer, measure);
+      pack_value(buffer, skipped);
+      pack_value(buffer, output.size());
+      for(size_t i=0; i< output.size(); i++){
+        pack_value(buffer, output[i].text);
+        pack_value(buffer, output[i].colour);
+        pack_value(buffer, output[i].flush);
+      }
+    }
+    bool unpack(const char *& pos, const char * end){
+    /** Read from a packed buffer, advancing pos. False if buffer is short*/
+      size_t n_lines;
+      if(!unpack_value(pos, end, err) || !unpack_value(pos, end, rank) || !unpack_value(pos, end, timing) || !unpack_value(pos, end, measure) || !unpack_value(pos, end, skipped) || !unpack_value(pos, end, n_lines)) return false;
+      output.resize(n_lines);
+      for(size_t i=0; i< n_lines; i++){
+        if(!unpack_value(pos, end, output[i].text) || !unpack_value(pos, end, output[i].colour) || !unpack_value(pos, end, output[i].flush)) return false;
+      }
+      return true;
+    }
+  };
+  /**< \internal Outcome and held-back output of one test*/
+
+  inline std::vector<std::string> get_err_list(TEST_ERR err){
+    /** Names of each error in bitmask err, most significant first*/
+    std::vector<std::string> names;
+    for(int i=max_err-1; i>0; --i){
+      //Run most to least significant
+      if((err & err_codes[i]) == err_codes[i]){
+        names.push_back(config::instance()->err_names[i]);
+      }
+    }
+    return names;
+  }
+  inline void append_err_names(std::string & text, TEST_ERR err){
+    /** \internal As get_err_names, appending to text without temporaries*/
+    for(int i=max_err-1; i>0; --i){
+      if((err & err_codes[i]) == err_codes[i]){
+        text += config::instance()->err_names[i];
+        text += ", ";
+      }
+    }
+  }
+  inline std::string get_err_names(TEST_ERR err){
+    /** \brief Names of errors in code
+    *
+    * Comma separated names of each error in bitmask err, most significant first, with trailing separator
+    */
+    std::string err_string="";
+    append_err_names(err_string, err);
+    return err_string;
+  }
+
+  class result_writer{
+  /** \brief Machine-readable results file
+  *
+  * Writes one record per test as it completes, so memory use doesn't grow with the suite. Derived classes give the format
+  */
+  protected:
+    std::ofstream file;
+  public:
+    virtual ~result_writer(){;}
+    bool open(const std::string & filename){
+      file.open(filename.c_str(), std::ios::out);
+      if(file.is_open()) begin();
+      return file.is_open();
+    }
+    void close(){
+      if(!file.is_open()) return;
+      end();
+      file.close();
+    }
+    void flush(){file.flush();}
+    virtual void begin(){;}/**< Write any header*/
+    virtual void end(){;}/**< Write any footer*/
+    virtual void write(const std::string & name, const test_result & result)=0;/**< Write record for one test*/
+  };
+
+  inline std::string json_quote(const std::string & text){
+    /** \internal Text as a quoted JSON string*/
+    std::string out = "\"";
+    for(size_t i=0; i< text.size(); i++){
+      char c = text[i];
+      if(c == '"' || c == '\\'){
+        out += '\\';
+        out += c;
+      }else if((unsigned char) c < 0x20){
+        char buffer[8];
+        std::snprintf(buffer, 8, "\\u%04x", (int) c);
+        out += buffer;
+      }else{
+        out += c;
+      }
+    }
+    return out+"\"";
+  }
+
+  class jsonl_writer : public result_writer{
+  /** \brief JSON Lines results
+  *
+  * One JSON object per line with name, errors (decoded names), code, timings, rank, whether skipped and output (report_info and report_err lines)
+  */
+    static std::string quote(const std::string & text){return json_quote(text);}
+  public:
+    virtual void write(const std::string & name, const test_result & result){
+      std::vector<std::string> errors = get_err_list(result.err);
+      file<<"{\"name\":"<<quote(name)<<",\"errors\":[";
+      for(size_t i=0; i< errors.size(); i++) file<<(i ? ",":"")<<quote(errors[i]);
+      file<<"],\"code\":"<<result.err<<",\"wall_s\":"<<result.timing.wall<<",\"user_s\":"<<result.timing.user<<",\"sys_s\":"<<result.timing.sys<<",\"rss_kb\":"<<result.timing.rss_kb<<",\"rank\":"<<result.rank<<",\"skipped\":"<<(result.skipped ? "true" : "false")<<",\"output\":[";
+      for(size_t i=0; i< result.output.size(); i++) file<<(i ? ",":"")<<quote(result.output[i].text);
+      file<<"]}\n";
+    }
+  };
+
+  class junit_writer : public result_writer{
+  /** \brief JUnit XML results
+  *
+  * A single testsuite, with one testcase per test. Failures carry the decoded error names and code, and output goes in system-out. Rank and code are testcase properties
+  */
+    static std::string escape(const std::string & text){
+      std::string out;
+      for(size_t i=0; i< text.size(); i++){
+        char c = text[i];
+        switch(c){
+          case '&': out += "&amp;"; break;
+          case '<': out += "&lt;"; break;
+          case '>': out += "&gt;"; break;
+          case '"': out += "&quot;"; break;
+          case '\'': out += "&apos;"; break;
+          default:
+            //Control characters other than whitespace are not allowed in XML
+            if((unsigned char) c < 0x20 && c != '\t' && c != '\n' && c != '\r') out += ' ';
+            else out += c;
+        }
+      }
+      return out;
+    }
+  public:
+    virtual void begin(){file<<"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<testsuites>\n<testsuite name=\"testbed\">\n";}
+    virtual void end(){file<<"</testsuite>\n</testsuites>\n";}
+    virtual void write(const std::string & name, const test_result & result){
+      file<<"  <testcase classname=\"testbed\" name=\""<<escape(name)<<"\" time=\""<<result.timing.wall<<"\">\n";
+      file<<"    <properties><property name=\"rank\" value=\""<<result.rank<<"\"/><property name=\"code\" value=\""<<result.err<<"\"/></properties>\n";
+      if(result.skipped) file<<"    <skipped/>\n";
+      if(result.err != TEST_PASSED){
+        std::string names = get_err_names(result.err);
+        file<<"    <failure message=\""<<escape(names.substr(0, names.size()-2))<<"\" type=\""<<result.err<<"\"/>\n";
+      }
+      if(!result.output.empty()){
+        file<<"    <system-out>";
+        for(size_t i=0; i< result.output.size(); i++) file<<escape(result.output[i].text)<<"\n";
+        file<<"</system-out>\n";
+      }
+      file<<"  </testcase>\n";
+    }
+  };
+
+  struct trace_event{
+    std::string name;
+    const std::string * category;/**< Name of the test it belongs to, or null*/
+    double start;/**< Time since trace_log::start, us*/
+    double duration;/**< us*/
+    int tid;/**< Trace row*/
+    int err;/**< Test's error code, or -1 for a trace_scope*/
+  };
+  /**< \internal One complete span in a trace*/
+
+  inline const std::string *& trace_category(){thread_local const std::string * category = nullptr; return category;}
+  /**< \internal Name of the test running on this thread, for trace_scope categories*/
+
+  class trace_log{
+  /** \internal \brief Timeline of tests and trace_scope spans, written in Chrome trace format. @see set_trace_file
+  *
+  * Spans go into a buffer per thread, so recording takes no lock. Buffers are owned here rather than by their threads, as worker threads end before the trace is written. Each buffer is a row (tid) in the trace, and other rows, e.g. for isolated worker processes, can be added by name
+  */
+    struct thread_buffer{
+      int tid;
+      std::string thread_name;
+      std::vector<trace_event> events;
+    };
+    std::mutex lock;/**< Guards buffers. Taken once per thread per trace*/
+    std::vector<std::unique_ptr<thread_buffer> > buffers;
+    std::atomic<bool> enabled{false};
+    std::atomic<size_t> epoch{0};/**< Changes when buffers are freed, so threads know their cached buffer is gone*/
+    std::chrono::steady_clock::time_point origin;
+    double origin_us = 0.0;/**< Wall-clock time of origin since the epoch, so ranks on different nodes line up*/
+
+    thread_buffer * add_buffer(const std::string & thread_name){
+      std::lock_guard<std::mutex> guard(lock);
+      std::unique_ptr<thread_buffer> buffer(new thread_buffer());
+      buffer->tid = (int) buffers.size();
+      buffer->thread_name = thread_name.empty() ? "thread "+mk_str(buffer->tid) : thread_name;
+      buffers.push_back(std::move(buffer));
+      return buffers.back().get();
+    }
+    thread_buffer & local(){
+      thread_local thread_buffer * buffer = nullptr;
+      thread_local size_t buffer_epoch = 0;
+      size_t now_epoch = epoch.load(std::memory_order_acquire);
+      if(!buffer || buffer_epoch != now_epoch){
+        buffer = add_buffer("");
+        buffer_epoch = now_epoch;
+      }
+      return *buffer;
+    }
+    std::string events_json(int rank){
+      /** Comma separated JSON objects for all spans and row names*/
+      std::string text;
+      char number[64];
+      std::lock_guard<std::mutex> guard(lock);
+      text += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":"+mk_str(rank)+",\"args\":{\"name\":\"rank "+mk_str(rank)+"\"}}";
+      for(size_t i=0; i< buffers.size(); i++){
+        text += ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":"+mk_str(rank)+",\"tid\":"+mk_str(buffers[i]->tid)+",\"args\":{\"name\":"+json_quote(buffers[i]->thread_name)+"}}";
+        const std::vector<trace_event> & events = buffers[i]->events;
+        for(size_t j=0; j< events.size(); j++){
+          text += ",\n{\"name\":"+json_quote(events[j].name)+",\"cat\":"+json_quote(events[j].category ? *events[j].category : "thread")+",\"ph\":\"X\"";
+          std::snprintf(number, 64, ",\"ts\":%.3f,\"dur\":%.3f", origin_us + events[j].start, events[j].duration);
+          text += number;
+          text += ",\"pid\":"+mk_str(rank)+",\"tid\":"+mk_str(events[j].tid);
+          if(events[j].err >= 0) text += ",\"args\":{\"err\":"+mk_str(events[j].err)+"}";
+          text += "}";
+        }
+      }
+      return text;
+    }
+  public:
+    static trace_log & instance(){static trace_log log; return log;}
+    bool on() const {return enabled.load(std::memory_order_relaxed);}
+    void start(){
+      /** Start recording, clearing anything recorded before*/
+      clear();
+      origin = std::chrono::steady_clock::now();
+      origin_us = std::chrono::duration<double, std::micro>(std::chrono::system_clock::now().time_since_epoch()).count();
+      enabled = true;
+    }
+    void stop(){enabled = false;}
+    void clear(){
+      std::lock_guard<std::mutex> guard(lock);
+      buffers.clear();
+      epoch++;
+    }
+    double now() const {return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();}
+    /**< Time since start, us*/
+    void record(const std::string & name, const std::string * category, double start, double end, int err=-1, int tid=-1){
+      /** Add span from start to end, from now(), on this thread's row or the given one*/
+      thread_buffer & buffer = local();
+      trace_event event;
+      event.name = name;
+      event.category = category;
+      event.start = start;
+      event.duration = end - start;
+      event.tid = (tid >= 0) ? tid : buffer.tid;
+      event.err = err;
+      buffer.events.push_back(std::move(event));
+    }
+    void name_thread(const std::string & thread_name){
+      /** Label this thread's row*/
+      thread_buffer & buffer = local();
+      if(buffer.thread_name != thread_name) buffer.thread_name = thread_name;
+    }
+    int row(const std::string & row_name){
+      /** Row with given label, added if needed, for spans not on any thread of ours*/
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        for(size_t i=0; i< buffers.size(); i++) if(buffers[i]->thread_name == row_name) return buffers[i]->tid;
+      }
+      return add_buffer(row_name)->tid;
+    }
+    bool write(const std::string & filename){
+      /** \brief Write trace file and stop
+      *
+      * With MPI, every rank must call this. Rank 0 gathers all spans, with pid the rank, and writes the file
+      */
+      enabled = false;
+      int rank = config::instance()->mpi_info.rank;
+      std::string text = events_json(rank);
+      clear();
+#ifdef USE_MPI
+      if(config::instance()->mpi_info.n_procs > 1){
+        int n_procs = config::instance()->mpi_info.n_procs;
+        int len = (int) text.size();
+        std::vector<int> lens(n_procs), offsets(n_procs);
+        MPI_Gather(&len, 1, MPI_INT, lens.data(), 1, MPI_INT, 0, config::instance()->mpi_comm);
+        std::string all;
+        if(rank == 0){
+          for(int i=0; i< n_procs; i++) offsets[i] = (i == 0) ? 0 : offsets[i-1] + lens[i-1];
+          all.resize(offsets[n_procs-1] + lens[n_procs-1]);
+        }
+        MPI_Gatherv(&text[0], len, MPI_CHAR, rank == 0 ? &all[0] : nullptr, lens.data(), offsets.data(), MPI_CHAR, 0, config::instance()->mpi_comm);
+        if(rank != 0) return true;
+        text.clear();
+        for(int i=0; i< n_procs; i++) text += (i ? ",\n" : "") + all.substr(offsets[i], lens[i]);
+      }
+#endif
+      std::ofstream file(filename.c_str(), std::ios::out);
+      if(!file.is_open()) return false;
+      file<<"{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"<<text<<"\n]}\n";
+      return file.good();
+    }
+  };
+
+  class trace_scope{
+  /** \brief Mark a span in the trace
+  *
+  * Create one in a test to add a span, nested inside the test's own, from here to the end of the enclosing scope, e.g.
+
+    {testbed::trace_scope span("assemble"); assemble();}
+
+  * Does nothing unless a trace file is set with set_trace_file. Works on threads a test starts too. @see set_trace_file
+  */
+    const char * name;
+    bool active;
+    double start;
+  public:
+    explicit trace_scope(const char * name) : name(name), active(trace_log::instance().on()), start(0.0){if(active) start = trace_log::instance().now();}
+    /**< Start span with given name*/
+    ~trace_scope(){if(active) trace_log::instance().record(name, trace_category(), start, trace_log::instance().now());}
+    trace_scope(const trace_scope &) = delete;
+    trace_scope & operator=(const trace_scope &) = delete;
   };
 
+  inline std::string mk_rank_str(const std::vector<int> & ranks){
+    /** \internal Compact printable list of sorted ranks, e.g. 0-3, 7*/
+    std::string text;
+    for(size_t i=0; i< ranks.size(); i++){
+      size_t j = i;
+      while(j+1 < ranks.size() && ranks[j+1] == ranks[j]+1) j++;
+      if(!text.empty()) text += ", ";
+      text += mk_str(ranks[i]);
+      if(j > i) text += "-"+mk_str(ranks[j]);
+      i = j;
+    }
+    return text;
+  }
+
   /**\brief Test controller
   *
   *Controls running of tests and their logging etc
@@ -341,6 +2805,181 @@ namespace testbed{
   *To report the errors by code, call test_bed->report_err(err); To report other salient information use test_bed->report_info(info, verbosity) where the second parameter is an integer describing the verbosity setting at which to print this info (0=always, the larger int means more and more detail).
   */
 
+  inline int & owning_test(){thread_local int test_id = -1; return test_id;}
+  /**< \internal Test whose run() this thread is executing, or -1. Reports from any other thread are buffered*/
+  inline int & thread_index(){thread_local int index = -1; return index;}
+  /**< \internal Index set by set_thread_index, or -1*/
+  inline void set_thread_index(int index){thread_index() = index;}
+  /**< \brief Order this thread's reports
+  *
+  * Reports from threads started inside a test's run() are buffered per thread and logged after run() returns, a thread at a time. Threads are taken in order of the index set here, e.g. omp_get_thread_num(), and any without one after those, in order of their text, so the log is the same whatever the scheduling. Call from the worker thread before it reports
+  */
+
+  struct thread_log{
+    int index = -1;/**< From set_thread_index*/
+    std::vector<log_line> lines;
+  };
+  /**< \internal Reports from one helper thread of a test*/
+
+  inline std::atomic<size_t> & next_generation(){static std::atomic<size_t> generation{0}; return generation;}
+  /**< \internal Counter giving each run of a test a unique number, so helper threads know a cached buffer is stale*/
+
+  struct test_slot{
+    std::string registered;/**< Name the test is registered under*/
+    std::function<void(test_entity *)> setup;/**< Setup function bound by tests::add, if any*/
+    double timeout_override = 0.0;/**< Time limit given to tests::add, or 0*/
+    std::string name;/**< test_entity::name, after setup*/
+    bool serial_only = false;
+    bool collective = true;
+    double timeout = 0.0;
+    size_t memory_budget = 0;
+    std::vector<std::string> fixtures;
+    std::atomic<bool> cancel_requested{false};/**< Set when the test overruns*/
+    std::atomic<bool> fixture_failed{false};/**< Set when a fixture the test asked for couldn't be built*/
+    std::atomic<size_t> generation{0};/**< Unique number of the current run, or 0 when not running*/
+    std::mutex log_lock;/**< Guards thread_logs. Taken once per helper thread per run*/
+    std::vector<std::unique_ptr<thread_log> > thread_logs;/**< Buffered reports of helper threads*/
+    log_line result_line;/**< The last report_err line of the current run, held until run() returns so its times can be added*/
+    bool result_held = false;
+  };
+  /**< \internal \brief Recipe for a test, and what the runner needs to know about it
+  *
+  * The test object itself is only built just before it runs, and freed straight after, so peak memory is that of the largest test rather than all of them. The other fields are copied from a test object built once when the test is added
+  */
+
+  inline double normal_quantile(double p){
+    /** \internal Standard normal quantile, by bisection on erfc. Only used a few times per run, so speed doesn't matter*/
+    double low = -40.0, high = 40.0;
+    for(int i=0; i< 100; i++){
+      double mid = 0.5*(low + high);
+      if(0.5*std::erfc(-mid/std::sqrt(2.0)) < p) low = mid;
+      else high = mid;
+    }
+    return 0.5*(low + high);
+  }
+  inline double student_t_quantile(double p, double dof){
+    /** \internal Student's t quantile, from the normal quantile by the Cornish-Fisher expansion (Abramowitz and Stegun 26.7.5). Good to about 1% for dof >= 4*/
+    double z = normal_quantile(p), z2 = z*z;
+    double g1 = z*(z2 + 1.0)/4.0;
+    double g2 = z*((5.0*z2 + 16.0)*z2 + 3.0)/96.0;
+    double g3 = z*(((3.0*z2 + 19.0)*z2 + 17.0)*z2 - 15.0)/384.0;
+    double g4 = z*((((79.0*z2 + 776.0)*z2 + 1482.0)*z2 - 1920.0)*z2 - 945.0)/92160.0;
+    return z + (g1 + (g2 + (g3 + g4/dof)/dof)/dof)/dof;
+  }
+
+  struct perf_baseline{
+    size_t n = 0;/**< Number of past runs used*/
+    double median = 0.0;/**< Median of past measurements, s*/
+    double limit = 0.0;/**< Measurements above this are regressions. 0 if too few runs to tell*/
+  };
+  /**< \internal Baseline performance of one test from the history*/
+
+  struct past_run{
+    double wall = -1.0;/**< Wall time in s, or -1 if not known*/
+    TEST_ERR err = TEST_PASSED;
+  };
+  /**< \internal Outcome of the most recent run of a test*/
+
+  class history_store{
+  /** \brief Past performance of tests
+  *
+  * Reads and appends to the history file set by set_history. Each line is a tab-separated record: test key, revision, host, Unix time, measurement in s, error code and wall time in s. Only the last few usable measurements and the last outcome of each test on this host are kept in memory
+  */
+    std::map<std::string, std::deque<double> > past;
+    std::map<std::string, past_run> latest;
+    static std::string clean(std::string text){
+      std::replace(text.begin(), text.end(), '\t', ' ');
+      std::replace(text.begin(), text.end(), '\n', ' ');
+      return text;
+    }
+  public:
+    std::string host;
+    history_store(){
+      char buffer[256] = {0};
+      host = (gethostname(buffer, sizeof(buffer)-1) == 0) ? clean(buffer) : "unknown";
+    }
+    static std::string find_revision(){
+      /** Source revision from set_revision or $TESTBED_REVISION, in that order*/
+      std::string revision = config::instance()->revision;
+      if(revision.empty() && getenv("TESTBED_REVISION")) revision = getenv("TESTBED_REVISION");
+      revision.erase(revision.find_last_not_of(" \n\r") + 1);
+      if(revision.empty()) revision = "unknown";
+      return clean(revision);
+    }
+    void load(const std::string & filename, size_t window){
+      /** Read measurements from this host, keeping the last window for each test. Runs which failed other than by being slow aren't usable*/
+      std::ifstream file(filename.c_str());
+      std::string line;
+      while(std::getline(file, line)){
+        if(line.empty() || line[0] == '#') continue;
+        std::vector<std::string> fields;
+        size_t start = 0, tab;
+        while((tab = line.find('\t', start)) != std::string::npos){
+          fields.push_back(line.substr(start, tab - start));
+          start = tab + 1;
+        }
+        fields.push_back(line.substr(start));
+        if(fields.size() < 6 || fields[2] != host) continue;
+        char * end;
+        double measure = std::strtod(fields[4].c_str(), &end);
+        long err = std::strtol(fields[5].c_str(), nullptr, 10);
+        if(end == fields[4].c_str() || !(measure > 0.0)) continue;
+        past_run & last = latest[fields[0]];
+        last.err = err;
+        last.wall = (fields.size() > 6) ? std::strtod(fields[6].c_str(), nullptr) : measure;
+        if((err & ~TEST_PERF_REGRESSION) != TEST_PASSED) continue;
+        std::deque<double> & runs = past[fields[0]];
+        runs.push_back(measure);
+        if(runs.size() > window) runs.pop_front();
+      }
+    }
+    past_run last(const std::string & key) const{
+      /** Most recent run of a test on this host, if any*/
+      auto it = latest.find(key);
+      return (it == latest.end()) ? past_run() : it->second;
+    }
+    perf_baseline baseline(const std::string & key, double confidence, double min_slowdown) const{
+      /** \brief Regression threshold for a test
+      *
+      * Times are roughly log-normal, so we fit mean and standard deviation to log times and take the upper end of the one-sided prediction interval for one new run, mean + t s sqrt(1 + 1/n)
+      */
+      perf_baseline base;
+      auto it = past.find(key);
+      if(it == past.end()) return base;
+      std::vector<double> runs(it->second.begin(), it->second.end());
+      base.n = runs.size();
+      std::sort(runs.begin(), runs.end());
+      base.median = (base.n%2 == 1) ? runs[base.n/2] : 0.5*(runs[base.n/2-1] + runs[base.n/2]);
+      const size_t min_runs = 5;
+      if(base.n < min_runs) return base;
+      double mean = 0.0, var = 0.0;
+      for(size_t i=0; i< base.n; i++) mean += std::log(runs[i]);
+      mean /= base.n;
+      for(size_t i=0; i< base.n; i++) var += (std::log(runs[i]) - mean)*(std::log(runs[i]) - mean);
+      var /= (base.n - 1);
+      double upper = mean + student_t_quantile(confidence, base.n - 1)*std::sqrt(var*(1.0 + 1.0/base.n));
+      base.limit = std::max(std::exp(upper), base.median*(1.0 + min_slowdown));
+      return base;
+    }
+    bool append(const std::string & filename, const std::vector<std::string> & keys, const std::vector<test_result> & results) const{
+      /** Append a record per test which ran. False if the file can't be written*/
+      std::ofstream file(filename.c_str(), std::ios::app);
+      if(!file) return false;
+      long now = (long)std::time(nullptr);
+      std::string revision = find_revision();
+      char buffer[num_buffer_len];
+      for(size_t i=0; i< results.size() && i< keys.size(); i++){
+        if(!(results[i].measure > 0.0)) continue;
+        file<<clean(keys[i])<<'\t'<<revision<<'\t'<<host<<'\t'<<now<<'\t';
+        std::snprintf(buffer, num_buffer_len, "%.9g", results[i].measure);
+        file<<buffer<<'\t'<<results[i].err<<'\t';
+        std::snprintf(buffer, num_buffer_len, "%.9g", results[i].timing.wall);
+        file<<buffer<<'\n';
+      }
+      return (bool)file;
+    }
+  };
+
   class tests{
   private:
 
@@ -349,86 +2988,1013 @@ namespace testbed{
   * Converts error code to printable string, adds code for reference and adds test name. Note code is bitmask and additional errors are appended together
   */
     std::string get_printable_error(TEST_ERR err, int test_id){
-      std::string err_string="";
+      std::string err_string;
+      format_error(err_string, err, test_id);
+      return err_string;
+  }
+    void format_error(std::string & text, TEST_ERR err, int test_id){
+    /** \internal As get_printable_error, but into text, reusing its storage*/
+      text.clear();
       if(err!=TEST_PASSED){
-        for(int i=max_err-1; i>0; --i){
-          //Run most to least significant
-          if((err & err_codes[i]) == err_codes[i]){
-            err_string +=config::instance()->err_names[i] + ", ";
-          }
-        }
-        err_string = "Error "+err_string+"(code "+mk_str(err)+") on";
+        text += "Error ";
+        append_err_names(text, err);
+        text += "(code ";
+        char buffer[num_buffer_len];
+        text.append(buffer, format_integer(buffer, buffer+num_buffer_len, err));
+        text += ") on";
       }
-      else err_string = "Passed";
-      return err_string+" test "+test_list[test_id]->name;
-  }
+      else text += "Passed";
+      text += " test ";
+      text += test_list[test_id]->name;
+    }
 
     std::fstream * outfile; /**< Output file handle*/
     int current_test_id;/**< Number in list of test being run*/
-    std::vector<std::shared_ptr<test_entity> > test_list;/**< List of tests to run*/
+    std::vector<std::unique_ptr<test_slot> > test_list;/**< List of tests to run*/
     int verbosity;/**< Verbosity level of output*/
+
+    std::vector<test_result> results;/**< Results of current run, by test id*/
+    bool hold_output = false;/**< Whether report output is being held back for ordered printing*/
+    size_t next_to_print = 0;/**< Position in run order of the next test whose held output is due*/
+    std::recursive_mutex print_lock;/**< Guards printing, which may happen from several threads*/
+    static const size_t max_spare_texts = 256;/**< Most spare line buffers kept*/
+    std::vector<std::string> spare_texts;/**< Storage of lines already printed, for report_err to reuse*/
+    std::mutex spare_lock;/**< Guards spare_texts*/
+    watchdog time_limits;/**< Enforces test time limits*/
+    std::chrono::steady_clock::time_point suite_deadline;/**< When to stop starting tests, if set_suite_timeout is used*/
+    bool in_worker = false;/**< Whether this is a forked worker process*/
+    int parent_pipe = -1;/**< In a worker, pipe to send output and results to the parent*/
+    std::mutex parent_pipe_lock;/**< Keeps messages to the parent whole*/
+    std::vector<std::unique_ptr<result_writer> > writers;/**< Machine-readable results files*/
+    bool defer_records = false;/**< Whether to wait for MPI reduction before writing results files*/
+    std::vector<std::string> history_keys;/**< Name of each test in the history, made unique*/
+    std::vector<perf_baseline> baselines;/**< Past performance of each test, if set_history is used*/
+    std::atomic<bool> halted{false};/**< Whether to start no more tests, with set_fail_fast*/
+    size_t n_candidates = 0;/**< Number of selected tests added, for sharding*/
+    fixture_store fixture_cache;/**< Shared fixtures of the current run*/
+    struct scaling_run{
+      std::string benchmark;
+      std::string csv_file;
+      std::vector<scaling_point> points;
+      std::vector<size_t> test_ids;/**< Test giving each point*/
+    };
+    /**< \internal A scaling_study, with the tests it was expanded into*/
+    std::vector<scaling_run> scaling_runs;/**< Scaling studies added*/
+#ifdef USE_MPI
+    std::map<int, MPI_Comm> scaling_comms;/**< Communicators of the lowest n ranks, by n. MPI_COMM_NULL on other ranks*/
+#endif
+
+    bool wanted(const std::string & name){
+    /** \internal Whether a test being added is selected and in this shard. Unknown names are wanted, so the error is reported*/
+      if(!test_factory::instance()->is_selected(name)) return false;
+      const test_selection & selection = config::instance()->selection;
+      return (n_candidates++ % selection.n_shards) == (size_t)(selection.shard - 1);
+    }
+
+    void print_line(const log_line & line){
+    /** \internal Write a line to log file and, coloured, to screen*/
+      std::lock_guard<std::recursive_mutex> guard(print_lock);
+      set_colour(line.colour);
+      my_print(outfile, line.text, 0, config::instance()->mpi_info.rank);
+      my_print(nullptr, line.text, 0, config::instance()->mpi_info.rank);
+      set_colour();
+      if(line.flush) flush_log();
+    }
+    thread_log * helper_log(test_slot & slot, size_t generation){
+    /** \internal This thread's buffer for a running test, made on its first report*/
+      struct cached_log{
+        size_t generation = 0;
+        thread_log * log = nullptr;
+      };
+      thread_local cached_log cache;
+      if(cache.generation != generation){
+        std::unique_ptr<thread_log> fresh(new thread_log());
+        cache.log = fresh.get();
+        cache.generation = generation;
+        std::lock_guard<std::mutex> guard(slot.log_lock);
+        slot.thread_logs.push_back(std::move(fresh));
+      }
+      return cache.log;
+    }
+    void merge_thread_logs(size_t test_id){
+    /** \internal Log helper threads' buffered reports, in set_thread_index order, then by text*/
+      std::vector<std::unique_ptr<thread_log> > logs;
+      {
+        std::lock_guard<std::mutex> guard(test_list[test_id]->log_lock);
+        logs.swap(test_list[test_id]->thread_logs);
+      }
+      if(logs.empty()) return;
+      std::sort(logs.begin(), logs.end(), [](const std::unique_ptr<thread_log> & a, const std::unique_ptr<thread_log> & b){
+        if(a->index != b->index) return (a->index >= 0 && b->index >= 0) ? a->index < b->index : a->index >= 0;
+        return std::lexicographical_compare(a->lines.begin(), a->lines.end(), b->lines.begin(), b->lines.end(), [](const log_line & x, const log_line & y){return x.text < y.text;});
+      });
+      for(size_t i=0; i< logs.size(); i++){
+        for(size_t j=0; j< logs[i]->lines.size(); j++) emit(logs[i]->lines[j], test_id);
+      }
+    }
+    void emit(log_line & line, int test_id){
+    /** \internal Print a line, or hold it with its test if tests are running in parallel. Lines from threads started by a running test are buffered, without locking, until it finishes. Held lines take line's text rather than copying it*/
+      bool valid = test_id >= 0 && test_id < (int)results.size();
+      if(valid && owning_test() != test_id){
+        test_slot & slot = *test_list[test_id];
+        size_t generation = slot.generation.load(std::memory_order_acquire);
+        if(generation != 0){
+          thread_log * log = helper_log(slot, generation);
+          log->index = thread_index();
+          log->lines.push_back(std::move(line));
+          return;
+        }
+      }
+      if(in_worker && valid){
+        send_line(line, test_id);
+        return;
+      }
+      if(hold_output && valid){
+        results[test_id].output.push_back(std::move(line));
+        return;
+      }
+      print_line(line);
+      //Keep it for the results files
+      if(!writers.empty() && valid) results[test_id].output.push_back(std::move(line));
+    }
+    void recycle(std::vector<log_line> & lines){
+    /** \internal Clear lines which are done with, keeping some of their storage for report_err to reuse*/
+      std::lock_guard<std::mutex> guard(spare_lock);
+      for(size_t i=0; i< lines.size() && spare_texts.size() < max_spare_texts; i++) spare_texts.push_back(std::move(lines[i].text));
+      lines.clear();
+    }
+    void reuse_text(std::string & text){
+    /** \internal Give text the storage of a line already printed, if there is one*/
+      std::lock_guard<std::mutex> guard(spare_lock);
+      if(spare_texts.empty()) return;
+      text.swap(spare_texts.back());
+      spare_texts.pop_back();
+    }
+    void write_record(size_t test_id){
+    /** \internal Write results files record for a complete test, and drop its output*/
+      for(size_t i=0; i< writers.size(); i++){
+        writers[i]->write(test_list[test_id]->name, results[test_id]);
+        if(results[test_id].err != TEST_PASSED) writers[i]->flush();
+      }
+      recycle(results[test_id].output);
+    }
+    void completed(size_t test_id){
+    /** \internal Test is done and its output printed*/
+      if(!defer_records) write_record(test_id);
+    }
+    void finish_held(const std::vector<size_t> & order, size_t test_id){
+    /** \internal Mark test done and print held output of all tests now complete in order*/
+      std::lock_guard<std::recursive_mutex> guard(print_lock);
+      results[test_id].done = true;
+      note_result(test_id);
+      while(next_to_print < order.size() && results[order[next_to_print]].done){
+        std::vector<log_line> & output = results[order[next_to_print]].output;
+        for(size_t i=0; i< output.size(); i++) print_line(output[i]);
+        completed(order[next_to_print]);
+        next_to_print++;
+      }
+    }
+    double time_limit(size_t test_id){
+    /** \internal Time limit for test, from test or default, and capped by any suite limit. 0 for none*/
+      double limit = test_list[test_id]->timeout > 0.0 ? test_list[test_id]->timeout : config::instance()->default_timeout;
+      if(config::instance()->suite_timeout > 0.0){
+        double left = std::max(std::chrono::duration<double>(suite_deadline - std::chrono::steady_clock::now()).count(), 1e-3);
+        limit = (limit > 0.0) ? std::min(limit, left) : left;
+      }
+      return limit;
+    }
+    bool suite_expired(){
+      return config::instance()->suite_timeout > 0.0 && std::chrono::steady_clock::now() >= suite_deadline;
+    }
+    void on_timeout(size_t test_id, double limit, pid_t pid){
+    /** \internal Called by watchdog when a test overruns. Logs at once, so the log has it even if the test never returns*/
+      test_list[test_id]->cancel_requested = true;
+      char buffer[50];
+      std::snprintf(buffer, 50, "%g s", limit);
+      log_line line;
+      line.text = "Test "+test_list[test_id]->name+" exceeded time limit of "+buffer+(pid > 0 ? ", killing worker" : ", cancelling");
+      line.colour = config::instance()->test_colours.fail;
+      line.flush = true;
+      print_line(line);
+      if(pid > 0) kill(pid, SIGKILL);
+    }
+    void run_one(size_t test_id){
+    /** \internal Run a single test and store its result and timing*/
+      if(halted){
+        skip(test_id);
+        release_fixtures(test_id);
+        return;
+      }
+      if(suite_expired()){
+        results[test_id].err = TEST_TIMEOUT;
+        report_info("Not run, suite time limit reached", 0, test_id);
+        report_err(TEST_TIMEOUT, test_id);
+        release_fixtures(test_id);
+        return;
+      }
+      entity_ptr test = build(test_id);
+      test_timer timer;
+      results[test_id].skipped = false;
+      results[test_id].rank = config::instance()->mpi_info.rank;
+      if(!in_worker) time_limits.add(test_id, time_limit(test_id));
+      owning_test() = test_id;
+      size_t generation = ++next_generation();
+      test_list[test_id]->generation.store(generation, std::memory_order_release);
+      bool tracing = trace_log::instance().on();
+      double trace_start = tracing ? trace_log::instance().now() : 0.0;
+      trace_category() = &test_list[test_id]->name;
+      heap_counters & heap = thread_heap();
+      heap = heap_counters();
+      heap.scope = generation;
+      bool counting = config::instance()->perf_counters;
+      perf_reading counts_start;
+      if(counting) counts_start = perf_counters::local().read_now();
+      int fp_checks = config::instance()->fp_checks;
+      if(fp_checks != FP_CHECK_OFF) clear_fp_flags();
+      if(fp_checks == FP_CHECK_TRAP) trap_fp(true);
+      timer.start();
+      results[test_id].err = test->run();
+      results[test_id].timing = timer.stop();
+      fp_flags fp_seen;
+      if(fp_checks == FP_CHECK_TRAP) trap_fp(false);
+      if(fp_checks != FP_CHECK_OFF) fp_seen = get_fp_flags();
+      double trace_end = tracing ? trace_log::instance().now() : 0.0;
+      perf_reading counts;
+      if(counting) counts = perf_counters::local().read_now() - counts_start;
+      results[test_id].measure = test->performance_measure(results[test_id].timing);
+      double bytes_moved = test->bytes_moved, flops = test->flops;
+      test.reset();
+      //Free the test, and anything it holds, straight away. Still counting heap, so what run() left in members isn't a leak
+      heap_counters usage = heap;
+      heap.scope = 0;
+      trace_category() = nullptr;
+      test_list[test_id]->generation.store(0, std::memory_order_release);
+      owning_test() = -1;
+      release_result(test_id, results[test_id].timing);
+      merge_thread_logs(test_id);
+      if(!in_worker) time_limits.remove(test_id);
+      if(test_list[test_id]->cancel_requested){
+        results[test_id].err |= TEST_TIMEOUT;
+        report_err(TEST_TIMEOUT, test_id);
+      }
+      if(test_list[test_id]->fixture_failed){
+        results[test_id].err |= TEST_OTHER;
+        report_err(TEST_OTHER, test_id);
+      }
+      report_info("Timing "+mk_str(results[test_id].timing)+" on test "+test_list[test_id]->name, 2, test_id);
+      if(counting) report_info("Counters "+mk_str(counts)+" on test "+test_list[test_id]->name, 2, test_id);
+      if((bytes_moved > 0.0 || flops > 0.0) && results[test_id].measure > 0.0) report_info(throughput_str(bytes_moved, flops, results[test_id].measure)+" on test "+test_list[test_id]->name, 1, test_id);
+      if(heap_hooks_installed()) check_heap(test_id, usage);
+      if(fp_checks != FP_CHECK_OFF) check_fp(test_id, fp_seen, fp_checks);
+      if(test_id < baselines.size() && baselines[test_id].limit > 0.0 && results[test_id].measure > baselines[test_id].limit){
+        const perf_baseline & base = baselines[test_id];
+        report_info("Slower than history: "+mk_str(results[test_id].measure)+" s against median "+mk_str(base.median)+" s of last "+mk_str(base.n)+" runs, limit "+mk_str(base.limit)+" s", 0, test_id);
+        results[test_id].err |= TEST_PERF_REGRESSION;
+        report_err(TEST_PERF_REGRESSION, test_id);
+      }
+      if(tracing) trace_log::instance().record(test_list[test_id]->name, &test_list[test_id]->name, trace_start, trace_end, results[test_id].err);
+      release_fixtures(test_id);
+      note_result(test_id);
+    }
+    void check_heap(size_t test_id, const heap_counters & usage){
+    /** \internal Log heap use of a test's run, any leak, and fail it if over budget*/
+      report_info("Heap "+mk_str(usage.allocations)+" allocations, "+mk_str(usage.bytes)+" bytes, peak "+mk_str(usage.peak)+" bytes on test "+test_list[test_id]->name, 2, test_id);
+      if(usage.live > 0) report_info("Leaked "+mk_str(usage.live)+" bytes in "+mk_str(usage.allocations - usage.frees)+" blocks", 1, test_id);
+      size_t budget = test_list[test_id]->memory_budget > 0 ? test_list[test_id]->memory_budget : config::instance()->memory_budget;
+      if(budget > 0 && (size_t)usage.peak > budget){
+        report_info("Peak heap "+mk_str(usage.peak)+" bytes over budget of "+mk_str(budget)+" bytes", 0, test_id);
+        results[test_id].err |= TEST_MEMORY;
+        report_err(TEST_MEMORY, test_id);
+      }
+    }
+    void check_fp(size_t test_id, const fp_flags & flags, int mode){
+    /** \internal Warn of floating-point exceptions in a test's run, and fail it for the serious ones if asked*/
+      std::string seen;
+      if(flags.raised & FE_INVALID) seen += ", invalid operation";
+      if(flags.raised & FE_DIVBYZERO) seen += ", division by zero";
+      if(flags.raised & FE_OVERFLOW) seen += ", overflow";
+      if(flags.denormal) seen += ", denormal operands, which may be much slower";
+      if(seen.empty()) return;
+      report_info("Floating-point exceptions on test "+test_list[test_id]->name+": "+seen.substr(2), 1, test_id);
+      if(mode < FP_CHECK_FAIL) return;
+      if(flags.raised & (FE_INVALID | FE_DIVBYZERO)){
+        results[test_id].err |= TEST_FP_EXCEPTION;
+        report_err(TEST_FP_EXCEPTION, test_id);
+      }
+      if(flags.denormal){
+        results[test_id].err |= TEST_DENORMAL;
+        report_err(TEST_DENORMAL, test_id);
+      }
+    }
+    entity_ptr build(size_t test_id){
+    /** \internal Construct a test from its recipe, ready to run*/
+      test_slot & slot = *test_list[test_id];
+      entity_ptr test = test_factory::instance()->create(slot.registered);
+      if(slot.setup) slot.setup(test.get());
+      test->parent = this;
+      test->id = test_id;
+      test->cancel_flag = &slot.cancel_requested;
+      slot.fixture_failed = false;
+      if(slot.timeout_override > 0.0) test->timeout = slot.timeout_override;
+      return test;
+    }
+    void release_fixtures(size_t test_id){
+    /** \internal Test is finished with its declared fixtures*/
+      for(size_t i=0; i< test_list[test_id]->fixtures.size(); i++) fixture_cache.release(test_list[test_id]->fixtures[i]);
+    }
+    void skip(size_t test_id){
+    /** \internal Log test as not run, after a failure with set_fail_fast*/
+      results[test_id].skipped = true;
+      report_info("Test "+test_list[test_id]->name+" not run, stopping after first failure", 0, test_id);
+    }
+    void note_result(size_t test_id){
+    /** \internal Stop starting tests if this one failed, with set_fail_fast. With several MPI ranks this waits for the results to be combined*/
+      if(config::instance()->fail_fast && results[test_id].err != TEST_PASSED && config::instance()->mpi_info.n_procs <= 1) halted = true;
+    }
+    std::vector<size_t> schedule(const history_store & history){
+    /** \internal \brief Order to run tests in, by the set_schedule policy
+    *
+    * serial_only tests go first, and collective before non-collective, so the runs of tests that can be shared out are as long as possible. With MPI, rank 0's order is used by all
+    */
+      std::vector<size_t> order(test_list.size());
+      for(size_t i=0; i< order.size(); i++) order[i] = i;
+      int policy = config::instance()->schedule;
+      if(policy == SCHEDULE_ADDED || history_keys.size() != test_list.size()) return order;
+      std::vector<past_run> last(test_list.size());
+      for(size_t i=0; i< last.size(); i++) last[i] = history.last(history_keys[i]);
+      std::stable_sort(order.begin(), order.end(), [this, &last, policy](size_t a, size_t b){
+        if(test_list[a]->serial_only != test_list[b]->serial_only) return test_list[a]->serial_only;
+        if(test_list[a]->collective != test_list[b]->collective) return test_list[a]->collective;
+        if(policy == SCHEDULE_FAILED_FIRST){
+          //Never run counts as failed
+          bool failed_a = last[a].wall < 0.0 || last[a].err != TEST_PASSED, failed_b = last[b].wall < 0.0 || last[b].err != TEST_PASSED;
+          if(failed_a != failed_b) return failed_a;
+        }
+        //Never run counts as longest
+        double wall_a = last[a].wall < 0.0 ? std::numeric_limits<double>::infinity() : last[a].wall;
+        double wall_b = last[b].wall < 0.0 ? std::numeric_limits<double>::infinity() : last[b].wall;
+        return wall_a > wall_b;
+      });
+#ifdef USE_MPI
+      if(config::instance()->mpi_info.n_procs > 1){
+        std::vector<unsigned long> sent(order.begin(), order.end());
+        MPI_Bcast(sent.data(), (int)sent.size(), MPI_UNSIGNED_LONG, 0, config::instance()->mpi_comm);
+        order.assign(sent.begin(), sent.end());
+      }
+#endif
+      return order;
+    }
+    void load_history(history_store & history){
+    /** \internal Give each test a unique key, and find its baseline from the history file*/
+      std::map<std::string, int> seen;
+      history_keys.resize(test_list.size());
+      baselines.assign(test_list.size(), perf_baseline());
+      for(size_t i=0; i< test_list.size(); i++){
+        //Same test added more than once, e.g. with different setup, gets #2, #3...
+        int count = ++seen[test_list[i]->name];
+        history_keys[i] = test_list[i]->name + (count > 1 ? "#"+mk_str(count) : "");
+      }
+      history.load(config::instance()->history_file, config::instance()->history_window);
+      for(size_t i=0; i< test_list.size(); i++) baselines[i] = history.baseline(history_keys[i], config::instance()->history_confidence, config::instance()->history_min_slowdown);
+    }
+    void report_slowest(){
+    /** \internal Print table of the slowest tests of this run to log and screen*/
+      size_t n_slow = std::min((size_t)config::instance()->n_slowest, results.size());
+      if(n_slow == 0) return;
+      std::vector<size_t> order;
+      for(size_t i=0; i< results.size(); i++) order.push_back(i);
+      std::stable_sort(order.begin(), order.end(), [this](size_t a, size_t b){return results[a].timing.wall > results[b].timing.wall;});
+      log_line line;
+      line.colour = config::instance()->test_colours.normal;
+      line.text = "Slowest "+mk_str(n_slow)+" tests:";
+      print_line(line);
+      for(size_t i=0; i< n_slow; i++){
+        line.text = "  "+mk_str(i+1)+". "+test_list[order[i]]->name+" ("+mk_str(results[order[i]].timing)+")";
+        print_line(line);
+      }
+    }
+    void report_allocations(){
+    /** \internal Log allocation counts for test objects and reports, at verbosity 3. Counts from isolated workers aren't included*/
+      if(!is_reported(3)) return;
+      alloc_counts & counts = alloc_counts::instance();
+      log_line line;
+      line.colour = config::instance()->test_colours.normal;
+      line.text = "Allocations: "+mk_str(counts.entities.load())+" test objects built in "+mk_str(counts.arena_blocks.load())+" arena blocks ("+mk_str(counts.arena_bytes.load())+" bytes), "+mk_str(counts.reports.load())+" reports formatted with "+mk_str(counts.format_growths.load())+" buffer growths";
+      print_line(line);
+    }
+    void report_scaling(){
+    /** \internal Tabulate each scaling study after a run, in the log and, from rank 0, its CSV file*/
+      for(size_t i=0; i< scaling_runs.size(); i++){
+        scaling_run & study = scaling_runs[i];
+        for(size_t j=0; j< study.points.size(); j++){
+          const test_result & result = results[study.test_ids[j]];
+          study.points[j].time = (result.err == TEST_PASSED && !result.skipped) ? result.measure : 0.0;
+        }
+        get_scaling_metrics(study.points);
+        log_line line;
+        line.colour = config::instance()->test_colours.normal;
+        line.text = "Scaling of "+study.benchmark+":";
+        print_line(line);
+        for(size_t j=0; j< study.points.size(); j++){
+          const scaling_point & point = study.points[j];
+          line.text = "  size "+mk_str(point.size)+", "+mk_str(point.threads)+" threads, "+mk_str(point.ranks)+" ranks: ";
+          if(point.time <= 0.0) line.text += "failed";
+          else line.text += mk_str(point.time)+" s, speedup "+mk_str(point.speedup)+", efficiency "+mk_str(point.efficiency)+(point.karp_flatt >= 0.0 ? ", Karp-Flatt "+mk_str(point.karp_flatt) : "")+(point.weak_efficiency >= 0.0 ? ", weak efficiency "+mk_str(point.weak_efficiency) : "");
+          print_line(line);
+        }
+        if(config::instance()->mpi_info.rank != 0 || study.csv_file.empty()) continue;
+        std::ofstream file(study.csv_file.c_str(), std::ios::out);
+        if(file.is_open()){
+          file<<"benchmark,size,threads,ranks,workers,time_s,speedup,efficiency,karp_flatt,weak_efficiency\n";
+          for(size_t j=0; j< study.points.size(); j++){
+            const scaling_point & point = study.points[j];
+            file<<study.benchmark<<","<<point.size<<","<<point.threads<<","<<point.ranks<<","<<point.workers()<<",";
+            if(point.time > 0.0) file<<point.time<<","<<point.speedup<<","<<point.efficiency;
+            else file<<",,";
+            file<<",";
+            if(point.karp_flatt >= 0.0) file<<point.karp_flatt;
+            file<<",";
+            if(point.weak_efficiency >= 0.0) file<<point.weak_efficiency;
+            file<<"\n";
+          }
+        }
+        if(!file.is_open() || !file.good()) my_print("Error writing "+study.csv_file, 0, config::instance()->mpi_info.rank);
+      }
+    }
+    void run_parallel(const std::vector<size_t> & order){
+    /** \internal Run a block of tests on the work-stealing pool. Output is held and printed in order as each prefix of the block completes*/
+      next_to_print = 0;
+      hold_output = true;
+      work_pool pool;
+      pool.run(order, config::instance()->n_threads, [this, &order](size_t test_id, int worker){
+        if(trace_log::instance().on()) trace_log::instance().name_thread("worker "+mk_str(worker));
+        run_one(test_id);
+        finish_held(order, test_id);
+      });
+      hold_output = false;
+    }
+
+    struct worker_process{
+      pid_t pid = -1;
+      int to_child = -1;/**< Pipe to send test ids*/
+      int from_child = -1;/**< Pipe to receive packed results*/
+      long test_id = -1;/**< Test being run, or -1 if idle*/
+      int trace_row = -1;/**< Row in the trace for this worker*/
+      double trace_start = 0.0;/**< When the current test was sent*/
+    };
+    /**< \internal An isolated worker and its pipes*/
+
+    bool send_to_parent(bool is_result, size_t test_id, const std::string & body){
+    /** \internal From a worker, send a line of output or a packed result to the parent. Each message is its length, whether it is a result, the test id and the body*/
+      std::string message;
+      pack_value(message, is_result);
+      pack_value(message, test_id);
+      message += body;
+      size_t len = message.size();
+      std::lock_guard<std::mutex> guard(parent_pipe_lock);
+      return write_all(parent_pipe, &len, sizeof(len)) && write_all(parent_pipe, message.data(), len);
+    }
+    void send_line(const log_line & line, size_t test_id){
+    /** \internal Send a line of output to the parent at once, so it survives if the test then crashes*/
+      std::string body;
+      pack_value(body, line.text);
+      pack_value(body, line.colour);
+      pack_value(body, line.flush);
+      send_to_parent(false, test_id, body);
+    }
+
+    void worker_main(int from_parent, int to_parent){
+    /** \internal Body of a forked worker. Runs each test id read from the parent and sends back packed results, until told to stop*/
+      //Crashes must kill us, so the parent sees the signal, and our copy of any unwritten log is the parent's to write
+      const int fatal_signals[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT, SIGTERM, SIGINT};
+      for(size_t i=0; i< sizeof(fatal_signals)/sizeof(int); i++) std::signal(fatal_signals[i], SIG_DFL);
+      std::set_terminate([](){std::abort();});
+      hold_output = true;
+      in_worker = true;
+      parent_pipe = to_parent;
+      //The log's writer thread was not forked with us, so anything queued would never be written
+      config::instance()->async_log = false;
+      //The parent traces our tests, and our buffers would be lost
+      trace_log::instance().stop();
+      size_t test_id;
+      while(read_all(from_parent, &test_id, sizeof(test_id)) && test_id < results.size()){
+        current_test_id = test_id;
+        run_one(test_id);
+        //Output has already been sent, line by line
+        std::string body;
+        results[test_id].pack(body);
+        if(!send_to_parent(true, test_id, body)) break;
+      }
+      _exit(0);
+    }
+    bool spawn_worker(worker_process & worker, std::vector<worker_process> & workers){
+    /** \internal Fork a worker process connected by a pair of pipes*/
+      int down[2], up[2];
+      if(pipe(down) != 0) return false;
+      if(pipe(up) != 0){
+        close(down[0]);
+        close(down[1]);
+        return false;
+      }
+      flush_log();
+      //The watchdog and log writer threads must not be mid-print as we fork, or the child could inherit a half-written buffer, or a lock no thread will release. Same order as on_timeout takes them
+      time_limits.hold();
+      print_lock.lock();
+      log_sink::instance()->hold();
+      //Anything still buffered would be written twice if the child inherited it
+      std::cout.flush();
+      if(outfile) outfile->flush();
+      for(size_t i=0; i< writers.size(); i++) writers[i]->flush();
+      pid_t pid = fork();
+      log_sink::instance()->release();
+      time_limits.release();
+      if(pid != 0) print_lock.unlock();
+      //A recursive mutex's owner is the parent's thread id, so the child can't unlock it. Being the only thread, it can start afresh
+      else new (&print_lock) std::recursive_mutex();
+      if(pid == 0){
+        for(size_t i=0; i< workers.size(); i++){
+          if(workers[i].pid <= 0) continue;
+          close(workers[i].to_child);
+          close(workers[i].from_child);
+        }
+        close(down[1]);
+        close(up[0]);
+        worker_main(down[0], up[1]);
+      }
+      close(down[0]);
+      close(up[1]);
+      if(pid < 0){
+        close(down[1]);
+        close(up[0]);
+        return false;
+      }
+      worker.pid = pid;
+      worker.to_child = down[1];
+      worker.from_child = up[0];
+      worker.test_id = -1;
+      return true;
+    }
+    void retire_worker(worker_process & worker, int & status){
+    /** \internal Close pipes to a worker and wait for it to exit*/
+      close(worker.to_child);
+      close(worker.from_child);
+      while(waitpid(worker.pid, &status, 0) < 0 && errno == EINTR);
+      worker.pid = -1;
+    }
+    void run_isolated(const std::vector<size_t> & order, int n_workers){
+    /** \internal \brief Run a block of tests in worker processes
+    *
+    * Tests are handed out in order to idle workers. If a worker dies mid-test, the test is failed with the cause and a new worker is forked for the remaining tests. Output is printed in order as each prefix of the block completes
+    */
+      next_to_print = 0;
+      hold_output = true;
+      std::deque<size_t> pending(order.begin(), order.end());
+      std::vector<worker_process> workers(std::max(1, std::min(n_workers, (int)order.size())));
+      bool tracing = trace_log::instance().on();
+      for(size_t i=0; i< workers.size() && tracing; i++) workers[i].trace_row = trace_log::instance().row("process "+mk_str(i));
+      void (*old_pipe_handler)(int) = std::signal(SIGPIPE, SIG_IGN);
+      //A dead worker's pipe must give us an error, not kill us
+
+      auto assign = [this, &pending, &order](worker_process & worker){
+        while(halted && !pending.empty()){
+          skip(pending.front());
+          finish_held(order, pending.front());
+          pending.pop_front();
+        }
+        //Send next test, or tell worker to stop if there are none
+        size_t test_id = pending.empty() ? (size_t)-1 : pending.front();
+        if(!write_all(worker.to_child, &test_id, sizeof(test_id))) return;
+        if(pending.empty()) return;
+        worker.test_id = test_id;
+        pending.pop_front();
+        time_limits.add(test_id, time_limit(test_id), worker.pid);
+        if(trace_log::instance().on()) worker.trace_start = trace_log::instance().now();
+      };
+      auto trace_test = [this, tracing](const worker_process & worker, size_t test_id){
+        if(tracing) trace_log::instance().record(test_list[test_id]->name, &test_list[test_id]->name, worker.trace_start, trace_log::instance().now(), results[test_id].err, worker.trace_row);
+      };
+      auto record_failure = [this, &order](size_t test_id, const std::string & what, TEST_ERR err){
+        log_line line;
+        line.text = "Test "+test_list[test_id]->name+" "+what;
+        line.colour = config::instance()->test_colours.fail;
+        line.flush = true;
+        results[test_id].err = err;
+        results[test_id].output.push_back(line);
+        finish_held(order, test_id);
+      };
+
+      for(size_t i=0; i< workers.size(); i++){
+        if(spawn_worker(workers[i], workers)) assign(workers[i]);
+      }
+      for(;;){
+        std::vector<struct pollfd> fds;
+        std::vector<size_t> polled;
+        for(size_t i=0; i< workers.size(); i++){
+          if(workers[i].pid <= 0 || workers[i].test_id < 0) continue;
+          struct pollfd fd = {workers[i].from_child, POLLIN, 0};
+          fds.push_back(fd);
+          polled.push_back(i);
+        }
+        if(fds.empty()) break;
+        if(poll(fds.data(), fds.size(), -1) < 0){
+          if(errno == EINTR) continue;
+          break;
+        }
+        for(size_t i=0; i< fds.size(); i++){
+          if(fds[i].revents == 0) continue;
+          worker_process & worker = workers[polled[i]];
+          size_t len = 0, test_id = worker.test_id;
+          std::string message;
+          bool got = read_all(worker.from_child, &len, sizeof(len));
+          if(got){
+            message.resize(len);
+            got = read_all(worker.from_child, &message[0], len);
+          }
+          const char * pos = message.data(), * end = pos + message.size();
+          bool is_result = false;
+          size_t sent_id;
+          got = got && unpack_value(pos, end, is_result) && unpack_value(pos, end, sent_id) && sent_id == test_id;
+          if(got && !is_result){
+            log_line line;
+            if(unpack_value(pos, end, line.text) && unpack_value(pos, end, line.colour) && unpack_value(pos, end, line.flush)){
+              results[test_id].output.push_back(line);
+              continue;
+            }
+            got = false;
+          }
+          time_limits.remove(test_id);
+          //If the time limit was hit just before the result came, the worker has been killed and the test is failed
+          got = got && !test_list[test_id]->cancel_requested;
+          std::vector<log_line> streamed;
+          streamed.swap(results[test_id].output);
+          if(got && results[test_id].unpack(pos, end)){
+            results[test_id].output.insert(results[test_id].output.begin(), streamed.begin(), streamed.end());
+            trace_test(worker, test_id);
+            finish_held(order, test_id);
+            worker.test_id = -1;
+            assign(worker);
+            if(worker.test_id < 0){
+              int status;
+              retire_worker(worker, status);
+            }
+            continue;
+          }
+          //Worker died mid-test. Keep what it printed before it went
+          results[test_id].output.swap(streamed);
+          int status = 0;
+          retire_worker(worker, status);
+          if(test_list[test_id]->cancel_requested) record_failure(test_id, "timed out, worker killed", TEST_TIMEOUT);
+          else if(WIFSIGNALED(status)) record_failure(test_id, "crashed, killed by "+signal_name(WTERMSIG(status)), TEST_OTHER);
+          else record_failure(test_id, "worker exited unexpectedly with status "+mk_str(WIFEXITED(status) ? WEXITSTATUS(status) : -1), TEST_OTHER);
+          trace_test(worker, test_id);
+          if(!pending.empty() && spawn_worker(worker, workers)) assign(worker);
+        }
+      }
+      //Anything left could not be run, e.g. if fork failed
+      while(!pending.empty()){
+        record_failure(pending.front(), "could not be run, no worker process available", TEST_OTHER);
+        pending.pop_front();
+      }
+      for(size_t i=0; i< workers.size(); i++){
+        int status;
+        if(workers[i].pid > 0) retire_worker(workers[i], status);
+      }
+      std::signal(SIGPIPE, old_pipe_handler);
+      hold_output = false;
+    }
+
+#ifdef USE_MPI
+    void reduce_mpi(const std::vector<size_t> & ids){
+    /** \internal \brief Combine results of a batch of tests over all ranks
+    *
+    * One bitwise-or allreduce covers the whole batch. Only if some rank failed do we gather the failures, as (test, code) pairs from failing ranks, to rank 0 to report them
+    */
+      MPI_Comm comm = config::instance()->mpi_comm;
+      int n_procs = config::instance()->mpi_info.n_procs;
+      std::vector<int> local(ids.size()), combined(ids.size());
+      for(size_t i=0; i< ids.size(); i++) local[i] = results[ids[i]].remote ? TEST_PASSED : results[ids[i]].err;
+      MPI_Allreduce(local.data(), combined.data(), (int)ids.size(), MPI_INT, MPI_BOR, comm);
+      bool any_failed = false;
+      for(size_t i=0; i< ids.size(); i++){
+        results[ids[i]].err = combined[i];
+        any_failed = any_failed || combined[i] != TEST_PASSED;
+      }
+      if(!any_failed) return;
+
+      std::vector<int> failures;
+      for(size_t i=0; i< ids.size(); i++){
+        if(local[i] == TEST_PASSED) continue;
+        failures.push_back(i);
+        failures.push_back(local[i]);
+      }
+      int n_local = failures.size();
+      bool is_root = config::instance()->mpi_info.rank == 0;
+      std::vector<int> counts(is_root ? n_procs : 0), offsets(is_root ? n_procs : 0);
+      MPI_Gather(&n_local, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, comm);
+      int n_all = 0;
+      for(int i=0; i< (int)counts.size(); i++){
+        offsets[i] = n_all;
+        n_all += counts[i];
+      }
+      std::vector<int> all_failures(std::max(n_all, 1));
+      MPI_Gatherv(failures.data(), n_local, MPI_INT, all_failures.data(), counts.data(), offsets.data(), MPI_INT, 0, comm);
+      if(!is_root) return;
+
+      //For each test, ranks failing with each code
+      std::map<int, std::map<int, std::vector<int> > > by_test;
+      for(int rank=0; rank< n_procs; rank++){
+        for(int i=offsets[rank]; i< offsets[rank]+counts[rank]; i+=2) by_test[all_failures[i]][all_failures[i+1]].push_back(rank);
+      }
+      log_line line;
+      line.colour = config::instance()->test_colours.fail;
+      line.flush = true;
+      for(auto test = by_test.begin(); test != by_test.end(); test++){
+        line.text = "Test "+test_list[ids[test->first]]->name+" failed on:";
+        for(auto code = test->second.begin(); code != test->second.end(); code++){
+          line.text += (code->second.size() > 1 ? " ranks " : " rank ")+mk_rank_str(code->second)+" with "+get_err_names(code->first)+"(code "+mk_str(code->first)+");";
+        }
+        print_line(line);
+      }
+    }
+    void run_sharded(const std::vector<size_t> & ids){
+    /** \internal \brief Share tests among ranks
+    *
+    * Each rank takes the next test index from a counter on rank 0 via atomic fetch-and-add, until all are taken. Each rank packs its results, which are gathered to rank 0 and printed there in order
+    */
+      MPI_Comm comm = config::instance()->mpi_comm;
+      int rank = config::instance()->mpi_info.rank, n_procs = config::instance()->mpi_info.n_procs;
+      long counter = 0, one = 1, next;
+      MPI_Win win;
+      MPI_Win_create(&counter, (rank == 0) ? sizeof(long) : 0, sizeof(long), MPI_INFO_NULL, comm, &win);
+
+      std::string packed;
+      hold_output = true;
+      for(;;){
+        MPI_Win_lock(MPI_LOCK_SHARED, 0, 0, win);
+        MPI_Fetch_and_op(&one, &next, MPI_LONG, 0, 0, MPI_SUM, win);
+        MPI_Win_unlock(0, win);
+        if(next >= (long)ids.size()) break;
+        current_test_id = ids[next];
+        run_one(ids[next]);
+        pack_value(packed, ids[next]);
+        results[ids[next]].pack(packed);
+        results[ids[next]].output.clear();
+      }
+      hold_output = false;
+      MPI_Win_free(&win);
+
+      int n_local = packed.size();
+      std::vector<int> counts(rank == 0 ? n_procs : 0), offsets(rank == 0 ? n_procs : 0);
+      MPI_Gather(&n_local, 1, MPI_INT, counts.data(), 1, MPI_INT, 0, comm);
+      int n_all = 0;
+      for(int i=0; i< (int)counts.size(); i++){
+        offsets[i] = n_all;
+        n_all += counts[i];
+      }
+      std::vector<char> all_packed(std::max(n_all, 1));
+      MPI_Gatherv(&packed[0], n_local, MPI_CHAR, all_packed.data(), counts.data(), offsets.data(), MPI_CHAR, 0, comm);
+      if(rank != 0) return;
+
+      for(int from=1; from< n_procs; from++){
+        const char * pos = all_packed.data() + offsets[from], * end = pos + counts[from];
+        size_t test_id;
+        while(unpack_value(pos, end, test_id) && test_id < results.size() && results[test_id].unpack(pos, end)) results[test_id].remote = true;
+      }
+      for(size_t i=0; i< ids.size(); i++){
+        for(size_t j=0; j< results[ids[i]].output.size(); j++) print_line(results[ids[i]].output[j]);
+        completed(ids[i]);
+      }
+    }
+#endif
+    void run_block(const std::vector<size_t> & ids){
+    /** \internal Run the given tests in order. With set_mpi_shard, runs of consecutive independent tests are shared among ranks*/
+#ifdef USE_MPI
+      if(config::instance()->mpi_shard && config::instance()->mpi_info.n_procs > 1){
+        size_t first = 0;
+        while(first < ids.size()){
+          bool collective = test_list[ids[first]]->collective;
+          size_t last = first;
+          while(last < ids.size() && test_list[ids[last]]->collective == collective) last++;
+          std::vector<size_t> segment(ids.begin()+first, ids.begin()+last);
+          if(collective) run_local(segment);
+          else run_sharded(segment);
+          first = last;
+        }
+        return;
+      }
+#endif
+      run_local(ids);
+    }
+    void run_local(const std::vector<size_t> & ids){
+    /** \internal Run the given tests in order. Runs of non serial_only tests are shared among threads if set_parallelism is used, or among worker processes if set_isolation is used*/
+      int n_isolated = config::instance()->n_isolated;
+      bool shared = (n_isolated > 1) || (n_isolated == 0 && config::instance()->n_threads > 1);
+      std::vector<size_t> block;
+      for(size_t i=0; i< ids.size(); i++){
+        current_test_id = ids[i];
+        if(shared && !test_list[ids[i]]->serial_only){
+          block.push_back(ids[i]);
+          continue;
+        }
+        if(!block.empty()) run_shared(block);
+        block.clear();
+        if(n_isolated > 0){
+          run_isolated(std::vector<size_t>(1, ids[i]), 1);
+        }else{
+          run_one(ids[i]);
+          completed(ids[i]);
+        }
+      }
+      if(!block.empty()) run_shared(block);
+    }
+    void run_shared(const std::vector<size_t> & block){
+    /** \internal Run a block of tests on threads or worker processes*/
+      if(config::instance()->n_isolated > 0) run_isolated(block, config::instance()->n_isolated);
+      else run_parallel(block);
+    }
+
   public:
 
-    template <typename T> void add(std::string name, std::function<void(T)> myfunc){
+    template <typename T> void add(std::string name, std::function<void(T)> myfunc, double timeout=0.0){
     /** \brief Add test to remit
     *
-    *Adds a previously registered test by name, calling the given setup function in the process.
+    *Adds a previously registered test by name, with the given setup function. The test object is built, and myfunc called on it, just before it runs, and it is freed straight after. It is also built once now, to read its name and flags. A non-zero timeout, in s, overrides the test's own time limit. Tests not selected by set_selection are skipped.
     */
-      std::shared_ptr<test_entity> eg = testbed::test_factory::instance()->create(name);
-      if(eg){
-        //Unpack raw pointer and invoke myfunc on eg
-        T test_instance = dynamic_cast<T> (eg.get());
-        myfunc(test_instance);
-        eg->parent = this;
-        //Add now set-up test to list
-        test_list.push_back(eg);
-      }else{
-        my_print("No test "+name);
-      }
+      //Cast to the test's own type to invoke myfunc on it
+      add_recipe(name, [myfunc](test_entity * test){myfunc(dynamic_cast<T>(test));}, timeout);
     }
-    void add(std::string name){
+    void add(std::string name, double timeout=0.0){
     /** \brief Add test to remit
     *
-    *Adds a previously registered test by name
+    *Adds a previously registered test by name. The test object is built just before it runs and freed straight after. A non-zero timeout, in s, overrides the test's own time limit. Tests not selected by set_selection are skipped.
     */
-      std::shared_ptr<test_entity> eg = testbed::test_factory::instance()->create(name);
-      if(eg){
-        eg->parent = this;
-        test_list.push_back(eg);
-      }else{
+      add_recipe(name, std::function<void(test_entity *)>(), timeout);
+    }
+    void add_recipe(const std::string & name, std::function<void(test_entity *)> setup, double timeout){
+    /** \internal \brief Record how to build a test
+    *
+    * Builds the test once, to check it exists and note its name and flags after setup, then frees it. It is built again just before it runs
+    */
+      if(!wanted(name)) return;
+      std::unique_ptr<test_slot> slot(new test_slot());
+      slot->registered = name;
+      slot->setup = setup;
+      slot->timeout_override = timeout;
+      entity_ptr eg = testbed::test_factory::instance()->create(name);
+      if(!eg){
         my_print("No test "+name);
+        return;
       }
+      if(setup) setup(eg.get());
+      slot->name = eg->name;
+      slot->serial_only = eg->serial_only;
+      slot->collective = eg->collective;
+      slot->timeout = (timeout > 0.0) ? timeout : eg->timeout;
+      slot->memory_budget = eg->memory_budget;
+      slot->fixtures = eg->fixtures;
+      test_list.push_back(std::move(slot));
     }
 
     /** \brief Log error
     *
-    * Logs error text corresponding to code err for test defined by test_id. Errors are always recorded.*/
+    * Logs error text corresponding to code err for test defined by test_id. Errors are always recorded. The last report_err from a test's run() is its result line, and gets the test's wall and CPU times, so each one made there is printed at the next, or when run() returns.*/
     void report_err(TEST_ERR err, int test_id=-1){
-      if(test_id == -1) test_id = current_test_id;
-      if(err ==TEST_PASSED) set_colour(config::instance()->test_colours.pass);
-      else set_colour(config::instance()->test_colours.fail);
+      heap_pause pause;
+      if(test_id == -1) test_id = (owning_test() >= 0) ? owning_test() : current_test_id;
+      //Build the message in a line kept per thread. If it is held, its text goes with it, and is replaced by that of a line already printed, so the steady state doesn't allocate
+      thread_local log_line line;
+      if(line.text.empty()) reuse_text(line.text);
+      size_t capacity = line.text.capacity();
+      format_error(line.text, err, test_id);
+      alloc_counts::instance().reports.fetch_add(1, std::memory_order_relaxed);
+      if(line.text.capacity() != capacity) alloc_counts::instance().format_growths.fetch_add(1, std::memory_order_relaxed);
+      line.colour = (err == TEST_PASSED) ? config::instance()->test_colours.pass : config::instance()->test_colours.fail;
+      line.flush = (err != TEST_PASSED);
+      if(owning_test() != test_id || test_id >= (int)test_list.size()){
+        emit(line, test_id);
+        return;
+      }
+      //From the test's own run(), so may be its result. Hold it, and print the one before, which can't be
+      test_slot & slot = *test_list[test_id];
+      if(slot.result_held) emit(slot.result_line, test_id);
+      std::swap(slot.result_line, line);
+      slot.result_held = true;
+    }
+    void release_result(size_t test_id, const test_timing & timing){
+    /** \internal Print a test's held result line, with its wall and CPU times*/
+      test_slot & slot = *test_list[test_id];
+      if(!slot.result_held) return;
+      slot.result_held = false;
+      char buffer[100];
+      int n = std::snprintf(buffer, 100, " (wall %.3f ms, CPU %.3f ms)", 1e3*timing.wall, 1e3*(timing.user + timing.sys));
+      slot.result_line.text.append(buffer, std::max(0, std::min(n, 99)));
+      emit(slot.result_line, test_id);
+    }
 
-      my_print(outfile, get_printable_error(err, test_id), 0, config::instance()->mpi_info.rank);
-      my_print(nullptr, get_printable_error(err, test_id), 0, config::instance()->mpi_info.rank);
-      set_colour();
+    void add_scaling(const scaling_study & study){
+    /** \brief Add a scaling study
+    *
+    * Adds a run of the benchmark for each size, thread count and rank count, named with all three, which run and are logged like any other test. After tests::run_tests, the timings are tabulated with speedups in the log and the study's CSV file. With MPI, every rank must add the same studies in the same order, as this makes a communicator for each rank count
+    */
+      entity_ptr eg = test_factory::instance()->create(study.benchmark);
+      if(!eg || !dynamic_cast<benchmark_entity *>(eg.get())){
+        my_print("No benchmark "+study.benchmark, 0, config::instance()->mpi_info.rank);
+        return;
+      }
+      eg.reset();
+      int n_procs = std::max(config::instance()->mpi_info.n_procs, 1);
+      std::vector<int> rank_counts = study.ranks.empty() ? std::vector<int>(1, n_procs) : study.ranks;
+      std::vector<std::pair<double, std::function<void(test_entity *)> > > sizes = study.sizes;
+      if(sizes.empty()) sizes.push_back(std::make_pair(0.0, std::function<void(test_entity *)>()));
+      scaling_run run;
+      run.benchmark = study.benchmark;
+      run.csv_file = study.csv_file;
+      for(size_t i=0; i< rank_counts.size(); i++){
+        int n_ranks = rank_counts[i];
+        if(n_ranks < 1 || n_ranks > n_procs){
+          my_print("Can't run "+study.benchmark+" on "+mk_str(n_ranks)+" ranks, only "+mk_str(n_procs)+" available", 0, config::instance()->mpi_info.rank);
+          continue;
+        }
+#ifdef USE_MPI
+        //Without set_mpi, MPI may not be running, so the benchmark gets no communicator
+        bool use_mpi = config::instance()->mpi_info.n_procs > 0;
+        if(use_mpi && scaling_comms.count(n_ranks) == 0){
+          MPI_Comm comm = MPI_COMM_NULL;
+          int rank = config::instance()->mpi_info.rank;
+          MPI_Comm_split(config::instance()->mpi_comm, rank < n_ranks ? 0 : MPI_UNDEFINED, rank, &comm);
+          scaling_comms[n_ranks] = comm;
+        }
+        MPI_Comm comm = use_mpi ? scaling_comms[n_ranks] : MPI_COMM_NULL;
+#endif
+        for(size_t j=0; j< sizes.size(); j++){
+          for(size_t k=0; k< study.threads.size(); k++){
+            scaling_point point;
+            point.size = sizes[j].first;
+            point.threads = std::max(study.threads[k], 1);
+            point.ranks = n_ranks;
+            std::function<void(test_entity *)> setup_size = sizes[j].second;
+            std::string label = " [size "+mk_str(point.size)+", "+mk_str(point.threads)+" threads, "+mk_str(point.ranks)+" ranks]";
+#ifdef USE_MPI
+            auto setup = [setup_size, point, label, comm, use_mpi](test_entity * test){
+#else
+            auto setup = [setup_size, point, label](test_entity * test){
+#endif
+              if(setup_size) setup_size(test);
+              benchmark_entity * bench = static_cast<benchmark_entity *>(test);
+              bench->threads = point.threads;
+#ifdef USE_MPI
+              bench->ranks = use_mpi ? point.ranks : 0;
+              bench->comm = comm;
+#else
+              bench->ranks = point.ranks;
+#endif
+              bench->name += label;
+            };
+            size_t before = test_list.size();
+            add_recipe(study.benchmark, setup, 0.0);
+            if(test_list.size() == before) continue;
+            run.points.push_back(point);
+            run.test_ids.push_back(before);
+          }
+        }
+      }
+      if(!run.points.empty()) scaling_runs.push_back(run);
+    }
+
+    /** \internal Get shared fixture, building if needed. @see test_entity::get_fixture*/
+    fixture * acquire_fixture(const std::string & name, bool declared, int test_id){
+    /** \internal Get a fixture for a test. If its constructor threw, the test will fail with TEST_OTHER*/
+      std::string error;
+      fixture * object = fixture_cache.acquire(name, declared, error);
+      if(!error.empty() && test_id >= 0 && test_id < (int)test_list.size()){
+        test_list[test_id]->fixture_failed = true;
+        report_info("Fixture "+name+" could not be built: "+error, 0, test_id);
+      }
+      return object;
     }
 
+    /** Whether report_info at verbosity verb_to_print would be printed*/
+    bool is_reported(int verb_to_print) const {return verb_to_print <= this->verbosity;}
+
     /** \brief Log other test info
     *
     *Records string info to the tests.log file and to screen, according to requested verbosity. @param info The text to report @param verb_to_print verbosity level at which to print this info @param test_id
     */
     void report_info(std::string info, int verb_to_print = 1, int test_id=-1){
-      set_colour(config::instance()->test_colours.info);
-      if(test_id == -1) test_id = current_test_id;
+      heap_pause pause;
+      if(test_id == -1) test_id = (owning_test() >= 0) ? owning_test() : current_test_id;
       if(verb_to_print <= this->verbosity){
-        my_print(outfile, info, 0, config::instance()->mpi_info.rank);
-        my_print(nullptr, info, 0, config::instance()->mpi_info.rank);
+        log_line line;
+        line.text = info;
+        line.colour = config::instance()->test_colours.info;
+        emit(line, test_id);
       }
-      set_colour();
     }
 
     tests(){
+      this->outfile = nullptr;
       this->verbosity = max_verbos;
+      spare_texts.reserve(max_spare_texts);
       check_term();
     }
     ~tests(){cleanup_tests();}
@@ -437,6 +4003,8 @@ namespace testbed{
       *
       *Opens reporting file.
       */
+      alloc_counts::instance().clear();
+      if(config::instance()->trace_file != "") trace_log::instance().start();
       outfile = new std::fstream();
       outfile->open(config::instance()->filename.c_str(), std::ios::out);
       if(!outfile->is_open()){
@@ -444,18 +4012,51 @@ namespace testbed{
         //can't log so return with empty test list
         return;
       }
+      //So a fatal signal can still write queued log text
+      log_sink::instance()->set_emergency_fd(outfile, open(config::instance()->filename.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC));
+      //Results files are written by rank 0, which gets all results
+      if(config::instance()->mpi_info.rank != 0) return;
+      if(config::instance()->junit_file != "") open_writer(new junit_writer(), config::instance()->junit_file);
+      if(config::instance()->jsonl_file != "") open_writer(new jsonl_writer(), config::instance()->jsonl_file);
+    }
+    void open_writer(result_writer * writer, const std::string & filename){
+    /** \internal Open a results file, taking ownership of writer*/
+      std::unique_ptr<result_writer> owned(writer);
+      if(owned->open(filename)) writers.push_back(std::move(owned));
+      else my_print("Error opening "+filename, 0, config::instance()->mpi_info.rank);
+    }
+
+    void add_all(){
+    /** \brief Add all selected tests
+    *
+    * Adds every registered test matching set_selection, in name order, without setup functions. With no selection, adds everything
+    */
+      test_factory * factory = test_factory::instance();
+      for(auto it = factory->factoryFunctionRegistry.begin(); it != factory->factoryFunctionRegistry.end(); it++){
+        if(factory->is_selected(it->first)) add(it->first);
+      }
     }
 
     void print_available(){
-    /** Print names of all registered tests */
+    /** Print names of all registered tests, with their tags */
       auto registry = testbed::test_factory::instance()->factoryFunctionRegistry;
-          for(auto it = registry.begin(); it !=registry.end(); it++) std::cout<<it->first<<'\n';
+      auto tags = testbed::test_factory::instance()->tagRegistry;
+      //Through my_print, so it keeps its place in the output with set_async_log
+      for(auto it = registry.begin(); it !=registry.end(); it++){
+        std::string line = it->first;
+        std::vector<std::string> & test_tags = tags[it->first];
+        for(size_t i=0; i< test_tags.size(); i++) line += (i ? ", " : " [")+test_tags[i]+(i+1 == test_tags.size() ? "]" : "");
+        my_print(line);
+      }
     }
 
     /** Delete test objects */
     void cleanup_tests(){
+      flush_log();
       if(outfile && outfile->is_open()){
         my_print("Testing complete and logged in " +config::instance()->filename, 0, config::instance()->mpi_info.rank);
+        flush_log();
+        log_sink::instance()->set_emergency_fd(outfile, -1);
         outfile->close();
       }else{
         set_colour(config::instance()->test_colours.fail);
@@ -463,29 +4064,97 @@ namespace testbed{
         set_colour();
       }
       delete outfile;
+      outfile = nullptr;
+      for(size_t i=0; i< writers.size(); i++) writers[i]->close();
+      writers.clear();
+      //Spans refer to test names, so write before freeing tests
+      if(trace_log::instance().on() && !trace_log::instance().write(config::instance()->trace_file)) my_print("Error writing "+config::instance()->trace_file, 0, config::instance()->mpi_info.rank);
       test_list.clear();
+      scaling_runs.clear();
+#ifdef USE_MPI
+      for(auto it = scaling_comms.begin(); it != scaling_comms.end(); it++) if(it->second != MPI_COMM_NULL) MPI_Comm_free(&it->second);
+      scaling_comms.clear();
+#endif
+      flush_log();
     }
 
     /** \brief Run scheduled tests
     *
-    *Runs each test in list and reports total errors found
+    *Runs each test in list and reports total errors found. If set_parallelism has been used, runs of consecutive tests are shared among threads, while any test_entity::serial_only test waits for all before it and runs alone. With MPI and set_mpi_reduce, results are combined across ranks after each batch.
     */
     void run_tests(){
       int total_errs = 0;
-      for(current_test_id=0; current_test_id< (int)test_list.size(); current_test_id++){
-        total_errs += (bool) test_list[current_test_id]->run();
+      results.assign(test_list.size(), test_result());
+      suite_deadline = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(config::instance()->suite_timeout));
+      bool any_limit = config::instance()->default_timeout > 0.0 || config::instance()->suite_timeout > 0.0;
+      fixture_cache.clear();
+      for(size_t i=0; i< test_list.size(); i++){
+        test_list[i]->cancel_requested = false;
+        any_limit = any_limit || test_list[i]->timeout > 0.0;
+        for(size_t j=0; j< test_list[i]->fixtures.size(); j++) fixture_cache.expect(test_list[i]->fixtures[j]);
+      }
+      history_store history;
+      bool use_history = !config::instance()->history_file.empty();
+      if(use_history) load_history(history);
+      else baselines.clear();
+      if(!use_history && config::instance()->schedule != SCHEDULE_ADDED) my_print("No history file set, so running tests in the order added", 0, config::instance()->mpi_info.rank);
+      std::vector<size_t> order = schedule(history);
+      if(config::instance()->selection.list_only){
+        my_print("Selected tests, in run order:", 0, config::instance()->mpi_info.rank);
+        for(size_t i=0; i< order.size(); i++) my_print("  "+test_list[order[i]]->name, 0, config::instance()->mpi_info.rank);
+        return;
+      }
+      if(any_limit) time_limits.start([this](size_t test_id, double limit, pid_t pid){on_timeout(test_id, limit, pid);});
+      if(trace_log::instance().on()) trace_log::instance().name_thread("main");
+      halted = false;
+      size_t batch = test_list.size();
+#ifdef USE_MPI
+      bool reduce = config::instance()->mpi_reduce && config::instance()->mpi_info.n_procs > 1;
+      if(reduce) batch = config::instance()->mpi_batch;
+      defer_records = reduce;
+#endif
+      for(size_t first=0; first< test_list.size(); first+=batch){
+        std::vector<size_t> ids(order.begin()+first, order.begin()+std::min(first+batch, test_list.size()));
+        run_block(ids);
+#ifdef USE_MPI
+        if(reduce){
+          {
+            //Shows time waiting for other ranks
+            trace_scope span("reduce results");
+            reduce_mpi(ids);
+          }
+          for(size_t i=0; i< ids.size(); i++){
+            write_record(ids[i]);
+            //Combined results are the same on all ranks, so all stop together
+            if(config::instance()->fail_fast && results[ids[i]].err != TEST_PASSED) halted = true;
+          }
+        }
+#endif
+      }
+      int n_skipped = 0;
+      for(size_t i=0; i< results.size(); i++){
+        total_errs += (bool) results[i].err;
         //Add one if is any error returned
+        n_skipped += results[i].skipped;
+      }
+      time_limits.stop();
+      fixture_cache.clear();
+      if(use_history && config::instance()->mpi_info.rank == 0 && !history.append(config::instance()->history_file, history_keys, results)){
+        my_print("Error writing "+config::instance()->history_file, 0, config::instance()->mpi_info.rank);
       }
+      report_slowest();
+      report_scaling();
+      report_allocations();
       if(total_errs > 0){
         set_colour(config::instance()->test_colours.fail);
-        my_print("\xe2\x9c\x97 ", true);
+        my_print("\xe2\x9c\x97 ", 0, config::instance()->mpi_info.rank, true);
         set_colour('*');
-        my_print(mk_str(total_errs)+" failed tests", config::instance()->mpi_info.rank);
+        my_print(mk_str(total_errs)+" failed tests"+(n_skipped > 0 ? ", "+mk_str(n_skipped)+" not run" : ""), 0, config::instance()->mpi_info.rank);
       }else{
         set_colour(config::instance()->test_colours.normal);
-        my_print("\xe2\x9c\x93 ", true);
+        my_print("\xe2\x9c\x93 ", 0, config::instance()->mpi_info.rank, true);
         set_colour('*');
-        my_print("All tests passed", config::instance()->mpi_info.rank);
+        my_print("All tests passed", 0, config::instance()->mpi_info.rank);
       }
       this->set_colour();
     }
@@ -508,9 +4177,94 @@ namespace testbed{
   };
 
   /** \copydoc tests::report_info */
-  inline void test_entity::report_info(std::string info, int verb_to_print){parent->report_info(info, verb_to_print);}
+  inline void test_entity::report_info(std::string info, int verb_to_print){parent->report_info(info, verb_to_print, id);}
+  /** \brief Log other test info, lazily
+  *
+  *Use as report_info(2) << "mismatch " << value; The message is only built if it will be printed at the current verbosity*/
+  inline info_stream test_entity::report_info(int verb_to_print){return info_stream(parent, verb_to_print, id, parent->is_reported(verb_to_print));}
+  inline info_stream::~info_stream(){if(active) parent->report_info(text, verb_to_print, test_id);}
   /** \copydoc tests::report_err */
-  inline void test_entity::report_err(int err){parent->report_err(err);}
+  inline void test_entity::report_err(int err){parent->report_err(err, id);}
+  template <typename T> inline const T * test_entity::get_fixture(const std::string & name){
+  /** \brief Get a shared fixture
+  *
+  * Returns the fixture registered as name with REGISTER_FIXTURE, building it if no test has yet. T is its class. Returns null if there is no such fixture, or it is not a T, or its constructor threw, which fails the test with TEST_OTHER. Declare use with uses_fixture in the constructor, so it can be freed as soon as all the tests using it are done, otherwise it lasts until the end of the run
+  */
+    static_assert(std::is_base_of<fixture, T>::value, "Fixtures must derive from fixture");
+    bool declared = std::find(fixtures.begin(), fixtures.end(), name) != fixtures.end();
+    return dynamic_cast<const T *>(parent->acquire_fixture(name, declared, id));
+  }
+
+  inline TEST_ERR test_entity::check_golden(const std::string & ref_name, const double * data, const std::vector<size_t> & shape, double tol, int tol_type){
+  /** \brief Check data against a golden reference file
+  *
+  * Compares data, an array of the given shape, against the file ref_name.golden in the directory set by set_golden_dir, using the tolerance stored in the file. Details of any mismatch are reported via report_info. Returns the error code for the test to report. With set_regenerate_golden, instead writes data as the new reference, with tolerance tol of type tol_type (see compare_arrays)
+  */
+    std::string filename = config::instance()->golden_dir+"/"+ref_name+".golden";
+    if(config::instance()->regenerate_golden){
+      mkdir(config::instance()->golden_dir.c_str(), 0777);
+      if(!write_golden(filename, data, shape, tol, tol_type)){
+        report_info("Cannot write golden file "+filename, 0);
+        return TEST_OTHER;
+      }
+      report_info("Regenerated golden file "+filename, 1);
+      return TEST_PASSED;
+    }
+
+    golden_file golden(filename);
+    if(!golden.ok()){
+      report_info(golden.error(), 0);
+      return TEST_OTHER;
+    }
+    if(golden.shape() != shape){
+      report_info("Shape does not match golden file "+filename, 0);
+      return TEST_WRONG_RESULT;
+    }
+    bool intact;
+    compare_summary summary = compare_golden(golden, data, intact);
+    if(!intact){
+      report_info("Golden file "+filename+" fails its checksum", 0);
+      return TEST_OTHER;
+    }
+    report_info(ref_name+": "+mk_str(summary), summary.passed() ? 2 : 0);
+    return summary.err();
+  }
+
+  inline TEST_ERR benchmark_entity::run(){
+  /** \brief Run the benchmark
+  *
+  *Warm up, calibrate calls per sample, take samples and report their statistics
+  */
+#ifdef USE_MPI
+    if(ranks > 0 && comm == MPI_COMM_NULL) return TEST_PASSED;
+    //Not one of this run's ranks
+#endif
+    double elapsed = 0.0;
+    do{
+      elapsed += agreed(time_calls(1));
+    }while(elapsed < warmup_time);
+
+    //Double calls per sample until one sample is long enough to time reliably
+    size_t n_calls = 1;
+    double sample_time = agreed(time_calls(n_calls));
+    while(sample_time < min_sample_time && n_calls < max_iterations){
+      n_calls = std::min(2*n_calls, max_iterations);
+      sample_time = agreed(time_calls(n_calls));
+    }
+
+    samples.resize(n_samples);
+    bool counting = config::instance()->perf_counters;
+    perf_reading counts;
+    if(counting) counts = perf_counters::local().read_now();
+    for(size_t i=0; i< n_samples; i++) samples[i] = agreed(time_calls(n_calls))/n_calls;
+    if(counting) counts = perf_counters::local().read_now() - counts;
+    stats = get_bench_stats(samples);
+    stats.iterations = n_calls;
+    report_info("Benchmark "+name+": "+mk_str(stats), 1);
+    if(counting) report_info("Counters per call "+mk_str(counts, (double) n_samples*n_calls), 2);
+    report_err(TEST_PASSED);
+    return TEST_PASSED;
+  }
 
 
   //Break this out because it's giant case
@@ -575,4 +4329,37 @@ namespace testbed{
 
 }
 
+#ifdef TESTBED_MEMORY_HOOKS
+/* Replacement global operator new and delete, counting heap use per test. Define TESTBED_MEMORY_HOOKS before including tests.h in exactly one source file. Over-aligned and direct malloc allocations aren't seen*/
+namespace{
+  bool testbed_heap_hooks = (testbed::heap_hooks_installed() = true);
+}
+void * operator new(std::size_t size){
+  for(;;){
+    void * ptr = testbed::heap_allocate(size);
+    if(ptr) return ptr;
+    std::new_handler handler = std::get_new_handler();
+    if(!handler) throw std::bad_alloc();
+    handler();
+  }
+}
+void * operator new[](std::size_t size){return ::operator new(size);}
+void * operator new(std::size_t size, const std::nothrow_t &) noexcept{
+  try{
+    return ::operator new(size);
+  }catch(...){
+    return nullptr;
+  }
+}
+void * operator new[](std::size_t size, const std::nothrow_t &) noexcept{return ::operator new(size, std::nothrow);}
+void operator delete(void * ptr) noexcept{testbed::heap_free(ptr);}
+void operator delete[](void * ptr) noexcept{testbed::heap_free(ptr);}
+void operator delete(void * ptr, const std::nothrow_t &) noexcept{testbed::heap_free(ptr);}
+void operator delete[](void * ptr, const std::nothrow_t &) noexcept{testbed::heap_free(ptr);}
+#if defined(__cpp_sized_deallocation)
+void operator delete(void * ptr, std::size_t) noexcept{testbed::heap_free(ptr);}
+void operator delete[](void * ptr, std::size_t) noexcept{testbed::heap_free(ptr);}
+#endif
+#endif
+
 #endif